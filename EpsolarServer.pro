@@ -32,7 +32,22 @@ TEMPLATE = app
 SOURCES += src/main.cpp \
     src/epsolar.cpp \
     src/controller.cpp \
-    src/gzip.cpp
+    src/gzip.cpp \
+    src/registerplan.cpp \
+    src/modbusworker.cpp \
+    src/lagmonitor.cpp \
+    src/registertable.cpp \
+    src/readingring.cpp \
+    src/rollup.cpp \
+    src/persistworker.cpp \
+    src/spool.cpp \
+    src/historystore.cpp \
+    src/sqlstore.cpp \
+    src/gorilla.cpp \
+    src/segmentstore.cpp \
+    src/downsample.cpp \
+    src/resultcache.cpp \
+    src/wireformat.cpp
 
 # The following define makes your compiler emit warnings if you use
 # any feature of Qt which as been marked deprecated (the exact warnings
@@ -48,7 +63,24 @@ DEFINES += QT_DEPRECATED_WARNINGS
 HEADERS += \
     src/epsolar.h \
     src/controller.h \
-    src/gzip.h
+    src/gzip.h \
+    src/registerplan.h \
+    src/modbusworker.h \
+    src/spscring.h \
+    src/lagmonitor.h \
+    src/registertable.h \
+    src/readingring.h \
+    src/accumulator.h \
+    src/rollup.h \
+    src/persistworker.h \
+    src/spool.h \
+    src/historystore.h \
+    src/sqlstore.h \
+    src/gorilla.h \
+    src/segmentstore.h \
+    src/downsample.h \
+    src/resultcache.h \
+    src/wireformat.h
 
 http {
     DEFINES += HTTP
@@ -59,9 +91,18 @@ http {
 }
 
 websocket {
-    QT += websockets
-    HEADERS += src/websocketserver.h
-    SOURCES += src/websocketserver.cpp
+    QT += network
+    HEADERS += src/websocketserver.h \
+        src/wsclient.h \
+        src/wsframe.h \
+        src/wsdeflate.h \
+        src/outqueue.h
+    SOURCES += src/websocketserver.cpp \
+        src/wsclient.cpp \
+        src/wsframe.cpp \
+        src/wsdeflate.cpp \
+        src/outqueue.cpp
+    LIBS += -lz
     DEFINES += WEBSOCKET
 }
 
@@ -23,6 +23,42 @@ CREATE DATABASE /*!32312 IF NOT EXISTS*/ `epsolar` /*!40100 DEFAULT CHARACTER SE
 
 USE `epsolar`;
 
+--
+-- Table structure for table `compaction`
+--
+
+DROP TABLE IF EXISTS `compaction`;
+/*!40101 SET @saved_cs_client     = @@character_set_client */;
+/*!40101 SET character_set_client = utf8 */;
+CREATE TABLE `compaction` (
+  `name` varchar(32) NOT NULL,
+  `watermark` datetime NOT NULL,
+  PRIMARY KEY (`name`)
+) ENGINE=InnoDB DEFAULT CHARSET=latin1;
+/*!40101 SET character_set_client = @saved_cs_client */;
+
+--
+-- Table structure for table `daily`
+--
+
+DROP TABLE IF EXISTS `daily`;
+/*!40101 SET @saved_cs_client     = @@character_set_client */;
+/*!40101 SET character_set_client = utf8 */;
+CREATE TABLE `daily` (
+  `id` int(11) NOT NULL AUTO_INCREMENT,
+  `device` int(11) NOT NULL DEFAULT '1',
+  `register` int(11) DEFAULT NULL,
+  `min` decimal(8,2) DEFAULT NULL,
+  `max` decimal(8,2) DEFAULT NULL,
+  `average` decimal(8,2) DEFAULT NULL,
+  `tstart` datetime DEFAULT NULL,
+  `tend` datetime DEFAULT NULL,
+  PRIMARY KEY (`id`),
+  UNIQUE KEY `device_register` (`device`,`register`,`tstart`),
+  KEY `tstart` (`tstart`)
+) ENGINE=InnoDB DEFAULT CHARSET=latin1;
+/*!40101 SET character_set_client = @saved_cs_client */;
+
 --
 -- Table structure for table `fiveMinute`
 --
@@ -32,13 +68,16 @@ DROP TABLE IF EXISTS `fiveMinute`;
 /*!40101 SET character_set_client = utf8 */;
 CREATE TABLE `fiveMinute` (
   `id` int(11) NOT NULL AUTO_INCREMENT,
+  `device` int(11) NOT NULL DEFAULT '1',
   `register` int(11) DEFAULT NULL,
   `min` decimal(8,2) DEFAULT NULL,
   `max` decimal(8,2) DEFAULT NULL,
   `average` decimal(8,2) DEFAULT NULL,
   `tstart` datetime DEFAULT NULL,
   `tend` datetime DEFAULT NULL,
-  PRIMARY KEY (`id`)
+  PRIMARY KEY (`id`),
+  UNIQUE KEY `device_register` (`device`,`register`,`tstart`),
+  KEY `tstart` (`tstart`)
 ) ENGINE=InnoDB DEFAULT CHARSET=latin1;
 /*!40101 SET character_set_client = @saved_cs_client */;
 
@@ -51,13 +90,39 @@ DROP TABLE IF EXISTS `hourly`;
 /*!40101 SET character_set_client = utf8 */;
 CREATE TABLE `hourly` (
   `id` int(11) NOT NULL AUTO_INCREMENT,
+  `device` int(11) NOT NULL DEFAULT '1',
   `register` int(11) DEFAULT NULL,
   `min` decimal(8,2) DEFAULT NULL,
   `max` decimal(8,2) DEFAULT NULL,
   `average` decimal(8,2) DEFAULT NULL,
+  `samples` int(11) NOT NULL DEFAULT '12',
   `tstart` datetime DEFAULT NULL,
   `tend` datetime DEFAULT NULL,
-  PRIMARY KEY (`id`)
+  PRIMARY KEY (`id`),
+  UNIQUE KEY `device_register` (`device`,`register`,`tstart`),
+  KEY `tstart` (`tstart`)
+) ENGINE=InnoDB DEFAULT CHARSET=latin1;
+/*!40101 SET character_set_client = @saved_cs_client */;
+
+--
+-- Table structure for table `monthly`
+--
+
+DROP TABLE IF EXISTS `monthly`;
+/*!40101 SET @saved_cs_client     = @@character_set_client */;
+/*!40101 SET character_set_client = utf8 */;
+CREATE TABLE `monthly` (
+  `id` int(11) NOT NULL AUTO_INCREMENT,
+  `device` int(11) NOT NULL DEFAULT '1',
+  `register` int(11) DEFAULT NULL,
+  `min` decimal(8,2) DEFAULT NULL,
+  `max` decimal(8,2) DEFAULT NULL,
+  `average` decimal(8,2) DEFAULT NULL,
+  `tstart` datetime DEFAULT NULL,
+  `tend` datetime DEFAULT NULL,
+  PRIMARY KEY (`id`),
+  UNIQUE KEY `device_register` (`device`,`register`,`tstart`),
+  KEY `tstart` (`tstart`)
 ) ENGINE=InnoDB DEFAULT CHARSET=latin1;
 /*!40101 SET character_set_client = @saved_cs_client */;
 
@@ -75,6 +140,7 @@ CREATE TABLE `registers` (
   `measure` varchar(8) DEFAULT NULL,
   `scale` double(8,3) DEFAULT NULL,
   `multibyte` enum('SOLE','LOW','HIGH','BITMAP') DEFAULT NULL,
+  `pollms` int(11) NOT NULL DEFAULT '0',
   PRIMARY KEY (`id`)
 ) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4;
 /*!40101 SET character_set_client = @saved_cs_client */;
@@ -90,7 +156,7 @@ CREATE TABLE `registers` (
 
 LOCK TABLES `registers` WRITE;
 /*!40000 ALTER TABLE `registers` DISABLE KEYS */;
-INSERT INTO `registers` VALUES (1,12544,'Charge voltage','V',0.010,'SOLE'),(2,12545,'Charge current','A',0.010,'SOLE'),(3,12546,'Charge watts','W',0.010,'SOLE'),(4,12556,'Load voltage','V',0.010,'SOLE'),(5,12557,'Load current','A',0.010,'SOLE'),(6,12558,'Load watts','W',0.010,'SOLE'),(7,12800,'Battery status',NULL,1.000,'BITMAP'),(8,12801,'Charge controller status',NULL,1.000,'BITMAP'),(9,12570,'Battery SOC','%',1.000,'SOLE'),(10,12573,'Battery temperature','C',0.010,'SOLE'),(11,13060,'Consumed energy today','Wh',100.000,'LOW'),(12,13061,'Consumed energy today','Wh',100.000,'HIGH'),(13,13068,'Generated energy today','Wh',100.000,'LOW'),(14,13069,'Generated energy today','Wh',100.000,'HIGH'),(15,13074,'Generated energy total','KWh',0.010,'LOW'),(16,13075,'Generated energy total','KWh',0.010,'HIGH'),(17,13076,'CO2 reduction','Kg',100.000,'LOW'),(18,13077,'CO2 reduction','Kg',100.000,'HIGH');
+INSERT INTO `registers` VALUES (1,12544,'Charge voltage','V',0.010,'SOLE',0),(2,12545,'Charge current','A',0.010,'SOLE',0),(3,12546,'Charge watts','W',0.010,'SOLE',0),(4,12556,'Load voltage','V',0.010,'SOLE',0),(5,12557,'Load current','A',0.010,'SOLE',0),(6,12558,'Load watts','W',0.010,'SOLE',0),(7,12800,'Battery status',NULL,1.000,'BITMAP',5000),(8,12801,'Charge controller status',NULL,1.000,'BITMAP',5000),(9,12570,'Battery SOC','%',1.000,'SOLE',0),(10,12573,'Battery temperature','C',0.010,'SOLE',10000),(11,13060,'Consumed energy today','Wh',100.000,'LOW',60000),(12,13061,'Consumed energy today','Wh',100.000,'HIGH',60000),(13,13068,'Generated energy today','Wh',100.000,'LOW',60000),(14,13069,'Generated energy today','Wh',100.000,'HIGH',60000),(15,13074,'Generated energy total','KWh',0.010,'LOW',300000),(16,13075,'Generated energy total','KWh',0.010,'HIGH',300000),(17,13076,'CO2 reduction','Kg',100.000,'LOW',300000),(18,13077,'CO2 reduction','Kg',100.000,'HIGH',300000);
 /*!40000 ALTER TABLE `registers` ENABLE KEYS */;
 UNLOCK TABLES;
 
@@ -0,0 +1,40 @@
+-- Upgrades an existing EpsolarServer database to the current schema.
+-- Run the statements below the last one you've already applied:
+--   mysql -uroot epsolar < dist/mysql_upgrade.sql
+
+-- Per-register poll intervals (milliseconds, 0 = every cycle):
+ALTER TABLE `registers` ADD COLUMN `pollms` int(11) NOT NULL DEFAULT '0';
+UPDATE `registers` SET `pollms`=5000 WHERE `register` IN (12800, 12801);
+UPDATE `registers` SET `pollms`=10000 WHERE `register`=12573;
+UPDATE `registers` SET `pollms`=60000 WHERE `register` IN (13060, 13061, 13068, 13069);
+UPDATE `registers` SET `pollms`=300000 WHERE `register` IN (13074, 13075, 13076, 13077);
+
+-- Multiple devices per server:
+ALTER TABLE `fiveMinute` ADD COLUMN `device` int(11) NOT NULL DEFAULT '1' AFTER `id`, ADD KEY `device_register` (`device`,`register`,`tstart`);
+ALTER TABLE `hourly` ADD COLUMN `device` int(11) NOT NULL DEFAULT '1' AFTER `id`, ADD KEY `device_register` (`device`,`register`,`tstart`);
+
+-- Replaying the spool must not duplicate buckets (remove any existing duplicates first):
+ALTER TABLE `fiveMinute` DROP KEY `device_register`, ADD UNIQUE KEY `device_register` (`device`,`register`,`tstart`);
+
+-- Incremental hourly compaction, resumes from its watermark:
+CREATE TABLE `compaction` (
+  `name` varchar(32) NOT NULL,
+  `watermark` datetime NOT NULL,
+  PRIMARY KEY (`name`)
+) ENGINE=InnoDB DEFAULT CHARSET=latin1;
+ALTER TABLE `fiveMinute` ADD KEY `tstart` (`tstart`);
+-- Hours used to start at their first five-minute row, and one could be compacted more than once. Fold
+-- each hour into one row starting on the hour, weighted by how many five-minute rows each part spans:
+CREATE TEMPORARY TABLE `hourlyMerged` AS SELECT `device`, `register`, MIN(`min`) AS `min`, MAX(`max`) AS `max`, SUM(`average` * `weight`) / SUM(`weight`) AS `average`, DATE_FORMAT(MIN(`tstart`), '%Y-%m-%d %H:00:00') AS `tstart`, MAX(`tend`) AS `tend` FROM (SELECT *, GREATEST(1, ROUND(TIMESTAMPDIFF(SECOND, `tstart`, `tend`) / 300)) AS `weight` FROM `hourly`) AS `parts` GROUP BY `device`, `register`, DATE(`tstart`), HOUR(`tstart`);
+DELETE FROM `hourly`;
+INSERT INTO `hourly`(`device`, `register`, `min`, `max`, `average`, `tstart`, `tend`) SELECT `device`, `register`, `min`, `max`, `average`, `tstart`, `tend` FROM `hourlyMerged`;
+DROP TEMPORARY TABLE `hourlyMerged`;
+ALTER TABLE `hourly` DROP KEY `device_register`, ADD UNIQUE KEY `device_register` (`device`,`register`,`tstart`);
+
+-- Daily and monthly rollups, maintained from hourly by the compaction:
+ALTER TABLE `hourly` ADD KEY `tstart` (`tstart`);
+CREATE TABLE `daily` LIKE `fiveMinute`;
+CREATE TABLE `monthly` LIKE `fiveMinute`;
+
+-- Five-minute rows per hour, so late ones can be merged in (older hours count as full):
+ALTER TABLE `hourly` ADD COLUMN `samples` int(11) NOT NULL DEFAULT '12' AFTER `average`;
@@ -0,0 +1,43 @@
+#ifndef ACCUMULATOR_H
+#define ACCUMULATOR_H
+
+#include <QtGlobal>
+
+// Running min/max/mean of one register over an averaging bucket, updated
+// per sample without keeping the samples. The sum is Kahan-compensated so
+// tens of thousands of small additions don't drift.
+struct Accumulator
+{
+    Accumulator() { reset(); }
+
+    quint32     count;
+    double      min;
+    double      max;
+    double      sum;
+    double      compensation;   // Low-order bits lost from 'sum' so far.
+
+    void reset()
+    {
+        count = 0;
+        min = 0;
+        max = 0;
+        sum = 0;
+        compensation = 0;
+    }
+
+    void add(double value)
+    {
+        if( count == 0 || value < min ) min = value;
+        if( count == 0 || value > max ) max = value;
+        count++;
+
+        double y = value - compensation;
+        double t = sum + y;
+        compensation = ( t - sum ) - y;
+        sum = t;
+    }
+
+    double mean() const { return count > 0 ? sum / count : 0; }
+};
+
+#endif // ACCUMULATOR_H
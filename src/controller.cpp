@@ -1,9 +1,14 @@
 #include "controller.h"
-#include "epsolar.h"
-#include "websocketserver.h"
+#include "downsample.h"
+#include "historystore.h"
+#include "wireformat.h"
+#include "lagmonitor.h"
+#include "modbusworker.h"
+#include "persistworker.h"
 #include "gzip.h"
 
 #ifdef WEBSOCKET
+# include "websocketserver.h"
 # include <QJsonArray>
 # include <QJsonDocument>
 # include <QJsonValue>
@@ -11,383 +16,961 @@
 #endif
 
 #include <QCoreApplication>
+#include <QtNumeric>
 
-#include <QWebSocket>
-
-#define LOW 1
-#define HIGH 2
-
-QHash<quint16, QVariantMap> v_registers;
-QList<quint16> l_registers;
+#include <algorithm>
+#include <climits>
 
 Controller::Controller(QSettings *settings, QObject *parent) : QObject(parent),
-    m_index(0)
+    m_persistThread(nullptr),
+    m_persist(nullptr),
+#ifdef WEBSOCKET
+    m_wssThread(nullptr),
+    m_wss(nullptr),
+#endif
+    m_history(nullptr)
 {
+    m_lagMonitor = new LagMonitor("main", settings->value("lagReportSeconds", 60).toInt(), this);
+    m_deadline = settings->value("epsolarCycleDeadlineMS", 1000).toInt();
+    m_readingsCapacity = settings->value("readingsCapacity", 8000).toInt();
+
+    // 6 hours of 10 second buckets, a day of minutes, a week of five minutes, 90 days of hours and 5 years of days:
+    m_rollupBuckets.resize(ROLLUP_LEVELS);
+    m_rollupBuckets[ROLLUP_TEN_SECONDS] = settings->value("rollup10sBuckets", 2160).toInt();
+    m_rollupBuckets[ROLLUP_MINUTE] = settings->value("rollup1mBuckets", 1440).toInt();
+    m_rollupBuckets[ROLLUP_FIVE_MINUTES] = settings->value("rollup5mBuckets", 2016).toInt();
+    m_rollupBuckets[ROLLUP_HOUR] = settings->value("rollup1hBuckets", 2160).toInt();
+    m_rollupBuckets[ROLLUP_DAY] = settings->value("rollup1dBuckets", 1830).toInt();
+    m_costReportMS = settings->value("lagReportSeconds", 60).toInt() * 1000;
+    m_keyframeMS = settings->value("deltaKeyframeSeconds", 60).toLongLong() * 1000;
+    m_cycleCost = 0;
+    m_cycleCount = 0;
+    m_costReport.start();
+    m_cache.setMaxBytes( settings->value("resultCacheMB", 4).toLongLong() * 1024 * 1024 );
+
 #ifdef WEBSOCKET
-    m_wss = new WebsocketServer(this);
-    connect( m_wss, &WebsocketServer::newConnection, this, &Controller::handleConnection );
+    // Clients are served from their own thread, frames are handed over ready to write:
+    qRegisterMetaType< QVector< quint32 > >();
+    m_wssThread = new QThread(this);
+    m_wss = new WebsocketServer(settings);
+    m_wss->moveToThread(m_wssThread);
+    connect( m_wssThread, &QThread::started, m_wss, &WebsocketServer::start );
+    connect( m_wssThread, &QThread::finished, m_wss, &QObject::deleteLater );
+    connect( m_wss, &WebsocketServer::clientConnected, this, &Controller::handleConnection, Qt::QueuedConnection );
+    connect( m_wss, &WebsocketServer::clientDisconnected, this, &Controller::handleDisconnect, Qt::QueuedConnection );
+    connect( m_wss, &WebsocketServer::messageReceived, this, &Controller::handlePacket, Qt::QueuedConnection );
+    connect( m_wss, &WebsocketServer::statsReady, this, &Controller::connectionStats, Qt::QueuedConnection );
+    connect( this, &Controller::messageReady, m_wss, &WebsocketServer::send, Qt::QueuedConnection );
+    connect( this, &Controller::broadcastReady, m_wss, &WebsocketServer::broadcast, Qt::QueuedConnection );
+    m_wssThread->start();
 #endif
 
-    m_db = QSqlDatabase::addDatabase(settings->value("databaseType", "QMYSQL").toString());
-    m_db.setDatabaseName(settings->value("databaseName", "epsolar").toString());
-    m_db.setHostName(settings->value("databaseHostname", "localhost").toString());
-    m_db.setUserName(settings->value("databaseUsername", "root").toString());
-    m_db.setPassword(settings->value("databasePassword", "").toString());
-    if( !m_db.open() )
+    m_databaseRetryMS = settings->value("databaseRetrySeconds", 30).toInt() * 1000;
+    m_databaseRetry.start();
+
+    // The native backend needs no database at all, registers then come from the cache:
+    if( settings->value("historyBackend", "sql").toString() != "native" )
     {
-        qWarning() << "Connection failed: " << m_db.lastError();
-        qApp->exit(1);
-        return;
+        m_db = QSqlDatabase::addDatabase(settings->value("databaseType", "QMYSQL").toString());
+        m_db.setDatabaseName(settings->value("databaseName", "epsolar").toString());
+        m_db.setHostName(settings->value("databaseHostname", "localhost").toString());
+        m_db.setUserName(settings->value("databaseUsername", "root").toString());
+        m_db.setPassword(settings->value("databasePassword", "").toString());
+
+        // Carry on without it, finished buckets are spooled until it's back:
+        if( !m_db.open() )
+            qWarning() << "Connection failed: " << m_db.lastError();
     }
 
+    // History is read from here, written by the PersistWorker's own store:
+    m_history = HistoryStore::create(settings, "main");
+    if( !m_history->open() )
+        qWarning() << "History unavailable: " << m_history->errorString();
+
     m_lastAverage = QDateTime::currentDateTime();
 
-    m_epsolar = new Epsolar(this);
-    QString devPath = settings->value("epsolarDevicePath", "/dev/ttyXRUSB0").toString();
-    if( !m_epsolar->open(devPath, 115200, 8, "N", 1) )
+    // Writes happen on their own thread and connection:
+    m_persistThread = new QThread(this);
+    m_persist = new PersistWorker(settings);
+    m_persist->moveToThread(m_persistThread);
+    connect( m_persistThread, &QThread::started, m_persist, &PersistWorker::start );
+    connect( m_persistThread, &QThread::finished, m_persist, &QObject::deleteLater );
+    connect( m_persist, &PersistWorker::stored, this, &Controller::historyStored, Qt::QueuedConnection );
+    m_persistThread->start();
+
+    if( !loadRegisters(settings) )
     {
-        qDebug() << "Failed to open " << devPath << m_epsolar->errorString();
+        qWarning() << "No registers to poll, neither from the database nor cached";
+        qApp->exit(1);
         return;
     }
-    connect( m_epsolar, &Epsolar::registerResult, this, &Controller::registerReceived );
+    loadDeadbands(settings);
+
+    QMap< quint16, int > intervals;
+    for( int x=0; x < m_registers.count(); x++ )
+        intervals[ m_registers.at(x).reg ] = m_registers.at(x).poll;
+
+    // Each bus does its serial I/O on its own thread, all polling concurrently:
+    QList< BusConfig > buses = ModbusWorker::loadBuses(settings);
+    foreach( const BusConfig &bus, buses )
+    {
+        foreach( const BusDevice &dev, bus.devices )
+        {
+            m_devices.append(dev.id);
+
+            DeviceState &state = m_state[dev.id];
+            state.values.fill( qQNaN(), m_registers.slotCount() );
+            state.words.fill( 0, m_registers.count() );
+            state.health.resize( m_registers.count() );
+            state.averages.resize( m_registers.count() );
+            state.readings.reset( m_registers.slotCount(), m_readingsCapacity );
+            state.rollup.reset( m_registers.count(), m_rollupBuckets, QDateTime::currentMSecsSinceEpoch() );
+            state.rollup.setUtcOffset( QDateTime::currentDateTime().offsetFromUtc() * 1000LL );
+            seedRollup(dev.id);
+        }
 
-    loadRegisters();
+        QThread *thread = new QThread(this);
+        ModbusWorker *worker = new ModbusWorker(settings, bus, intervals);
+        worker->moveToThread(thread);
+        connect( thread, &QThread::started, worker, &ModbusWorker::start );
+        connect( thread, &QThread::finished, worker, &QObject::deleteLater );
+        connect( worker, &ModbusWorker::batchesReady, this, &Controller::batchesReady, Qt::QueuedConnection );
 
-    m_timer.setInterval(settings->value("epsolarPollFrequencyMS", 50).toInt());
-    m_timer.setSingleShot(false);
-    connect( &m_timer, &QTimer::timeout, this, &Controller::timerTriggered );
-    m_timer.start();
+        m_modbusThreads.append(thread);
+        m_workers.append(worker);
+        thread->start();
+    }
 }
 
-void Controller::addRegister(quint16 reg, const QString &name, double scale, int lowhigh)
+Controller::~Controller()
 {
-    QVariantMap val;
-    val["n"] = name;
-    if( scale != 0 )
-        val["scale"] = scale;
-    if( lowhigh != 0 )
-        val["lowhigh"] = lowhigh;
-    v_registers[reg] = val;
+    foreach( QThread *thread, m_modbusThreads )
+    {
+        thread->quit();
+        thread->wait();
+    }
+
+    if( m_persistThread )
+    {
+        m_persistThread->quit();
+        m_persistThread->wait();
+    }
+
+#ifdef WEBSOCKET
+    if( m_wssThread )
+    {
+        m_wssThread->quit();
+        m_wssThread->wait();
+    }
+#endif
+
+    delete m_history;
 }
 
-bool Controller::loadRegisters()
+void Controller::loadDeadbands(QSettings *settings)
 {
+    // How far a value may drift, in its own units, before delta subscribers
+    // hear of it. By register, either half of a 32-bit value will do:
+    m_deadbands.fill( 0, m_registers.slotCount() );
+    settings->beginGroup("deadbands");
+    foreach( QString key, settings->childKeys() )
+    {
+        int index = m_registers.indexOf( key.toInt() );
+        if( index < 0 )
+        {
+            qWarning() << "Deadband for unknown register" << key;
+            continue;
+        }
+        m_deadbands[ m_registers.at(index).slot ] = settings->value(key).toDouble();
+    }
+    settings->endGroup();
+}
+
+bool Controller::loadRegisters(QSettings *settings)
+{
+    // Poll intervals in the settings file override the registers table:
+    QMap< quint16, int > overrides;
+    settings->beginGroup("pollIntervals");
+    foreach( QString key, settings->childKeys() )
+        overrides[ key.toInt() ] = settings->value(key).toInt();
+    settings->endGroup();
+
+    // The last register table read from the database, for starting without one:
+    QSettings cache( settings->value("registerCachePath", "/var/lib/epsolar/registers.cache").toString(), QSettings::IniFormat );
+
     QSqlQuery query(m_db);
-    query.prepare("SELECT register, name, measure, scale, multibyte FROM registers ORDER BY id");
-    if( !query.exec() )
-        return false;
+    bool hasPoll = true;
+    bool fromDb = m_db.isOpen();
+    if( fromDb )
+    {
+        query.prepare("SELECT register, name, measure, scale, multibyte, pollms FROM registers ORDER BY id");
+        if( !query.exec() )
+        {
+            // Schema predates per-register poll intervals:
+            hasPoll = false;
+            query.prepare("SELECT register, name, measure, scale, multibyte FROM registers ORDER BY id");
+            fromDb = query.exec();
+        }
+    }
 
-    while( query.next() )
+    if( fromDb )
     {
-        quint16 reg = query.value(0).toInt();
-        QString name = query.value(1).toString();
-        QString measure = query.value(2).toString();
-        qreal scale = query.value(3).toReal();
-        QString multibyte = query.value(4).toString();
+        cache.remove("registers");
+        cache.beginWriteArray("registers");
+        int row = 0;
+        while( query.next() )
+        {
+            cache.setArrayIndex(row++);
+            cache.setValue( "register", query.value(0).toInt() );
+            cache.setValue( "name", query.value(1).toString() );
+            cache.setValue( "measure", query.value(2).toString() );
+            cache.setValue( "scale", query.value(3).toReal() );
+            cache.setValue( "multibyte", query.value(4).toString() );
+            cache.setValue( "pollms", hasPoll ? query.value(5).toInt() : 0 );
+        }
+        cache.endArray();
+        cache.sync();
+    }
+    else
+        qWarning() << "Registers table unavailable, using the cached copy: " << cache.fileName();
 
-        int lh = 0;
+    int size = cache.beginReadArray("registers");
+    for( int x=0; x < size; x++ )
+    {
+        cache.setArrayIndex(x);
+
+        quint16 reg = cache.value("register").toInt();
+        QString name = cache.value("name").toString();
+        QString measure = cache.value("measure").toString();
+        qreal scale = cache.value("scale").toReal();
+        QString multibyte = cache.value("multibyte").toString();
+        int poll = cache.value("pollms", 0).toInt();
+        if( overrides.contains(reg) )
+            poll = overrides[reg];
+
+        quint8 lh = SOLE;
         if( multibyte == "LOW" ) lh = LOW;
         else if( multibyte == "HIGH" ) lh = HIGH;
 
-        addRegister( reg, name, scale, lh );
+        m_registers.add( reg, name, measure, scale, lh, poll );
     }
+    cache.endArray();
 
-    QList<quint16> regs = v_registers.keys();
-    foreach( quint16 key, regs )
-        l_registers.append(key);
+    m_registers.compile();
 
-    qDebug() << "Loaded registers: " << v_registers;
+    for( int x=0; x < m_registers.count(); x++ )
+    {
+        const RegisterDescriptor &desc = m_registers.at(x);
+        qDebug() << "Loaded register: " << desc.reg << desc.name << "scale" << desc.scale << "slot" << desc.slot << "partner" << desc.partner;
+    }
 
+    return m_registers.count() > 0;
+}
+
+bool Controller::historyReady()
+{
+    if( m_history->isOpen() )
+        return true;
+
+    // Don't hold up every request while it's down, only try now and then:
+    if( m_databaseRetry.elapsed() < m_databaseRetryMS )
+        return false;
+    m_databaseRetry.restart();
+
+    if( !m_history->open() )
+        return false;
+
+    qDebug() << "History store (re)opened";
     return true;
 }
 
-void Controller::addAverages()
+void Controller::historyStored(int tier, qint64 from, qint64 to)
+{
+    m_cache.invalidate(tier, from, to);
+}
+
+QList< quint16 > Controller::registerList(quint16 reg) const
+{
+    // A single register, or all of them for 0:
+    QList< quint16 > regs;
+    if( reg > 0 )
+        regs.append(reg);
+    return regs;
+}
+
+QString Controller::registerName(quint16 reg) const
+{
+    int index = m_registers.indexOf(reg);
+    if( index < 0 )
+        return QString::number(reg);
+    return m_registers.at(index).name;
+}
+
+void Controller::addAverages(quint16 device)
 {
     QDateTime now = QDateTime::currentDateTime();
-    foreach( quint16 reg, v_registers.keys() )
-    {
-        QString key = v_registers[reg]["n"].toString();
-        m_averages[ reg ].append( m_values[key].toDouble() );
-    }
+    qint64 nowMS = now.toMSecsSinceEpoch();
 
-    if( m_lastAverage.secsTo(now) >= 300 )
+    // Close the bucket on the wall clock's five minute marks, as the in-memory rollup does,
+    // before this cycle's samples go into the next one:
+    qint64 offset = now.offsetFromUtc() * 1000LL;
+    if( ( nowMS + offset ) / 300000 != ( m_lastAverage.toMSecsSinceEpoch() + offset ) / 300000 )
     {
+        // Pick up daylight saving changes:
+        QHash< quint16, DeviceState >::iterator it;
+        for( it = m_state.begin(); it != m_state.end(); ++it )
+            it.value().rollup.setUtcOffset(offset);
+
         saveAverages();
         clearAverages();
 
+        // Closed buckets change the answers covering them, from memory or the store:
+        qint64 last = m_lastAverage.toMSecsSinceEpoch();
+        m_cache.invalidate( TIER_FIVE_MINUTES, last, nowMS + 1 );
+        if( m_lastAverage.time().hour() != now.time().hour() || m_lastAverage.date() != now.date() )
+            m_cache.invalidate( TIER_HOUR, last, nowMS + 1 );
+        if( m_lastAverage.date() != now.date() )
+            m_cache.invalidate( TIER_DAY, last, nowMS + 1 );
+        if( m_lastAverage.date().month() != now.date().month() )
+            m_cache.invalidate( TIER_MONTH, last, nowMS + 1 );
+
         // Calculate the hourly?
         if( m_lastAverage.time().hour() != now.time().hour() )
         {
             // Compress old (pre-24-hours-ago) readings into houry table:
             compressHourly();
-            trimForHourly();
         }
         m_lastAverage = now;
     }
+
+    DeviceState &state = m_state[device];
+    for( int x=0; x < m_registers.count(); x++ )
+    {
+        // Don't let a missed read drag a stale value into the averages:
+        if( !isFresh(state, x, nowMS) )
+            continue;
+
+        double value = state.values[ m_registers.at(x).slot ];
+        state.averages[x].add(value);
+        state.rollup.add( x, nowMS, value );
+    }
 }
 
-void Controller::clearAverages()
+void Controller::seedRollup(quint16 device)
 {
-    m_averages.clear();
-    // ... okay, that's simple enough.
+    if( !m_history->isOpen() )
+        return;
+
+    Rollup &rollup = m_state[device].rollup;
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    // Older hours first, they come from the hourly tier:
+    qint64 hourSince = rollup.align( ROLLUP_HOUR, now - m_rollupBuckets[ROLLUP_HOUR] * Rollup::width(ROLLUP_HOUR) );
+    qint64 fiveSince = rollup.align( ROLLUP_FIVE_MINUTES, now - m_rollupBuckets[ROLLUP_FIVE_MINUTES] * Rollup::width(ROLLUP_FIVE_MINUTES) );
+
+    quint32 limit = m_registers.count() * qMax( m_rollupBuckets[ROLLUP_HOUR], m_rollupBuckets[ROLLUP_FIVE_MINUTES] );
+    QList< HistoryRow > hours = m_history->read( TIER_HOUR, device, hourSince, now, QList< quint16 >(), limit );
+    foreach( const HistoryRow &row, hours )
+        rollup.seed( ROLLUP_HOUR, m_registers.indexOf(row.reg), row.tstart, row.min, row.max, row.average );
+
+    // Then the last day or so of five minute averages, which close their hours as they go:
+    QList< HistoryRow > fives = m_history->read( TIER_FIVE_MINUTES, device, fiveSince, now, QList< quint16 >(), limit );
+    foreach( const HistoryRow &row, fives )
+        rollup.seed( ROLLUP_FIVE_MINUTES, m_registers.indexOf(row.reg), row.tstart, row.min, row.max, row.average );
+
+    // The store has nothing older at these resolutions than what was just read.
+    // Days are only whole from the first full day of hours on:
+    rollup.seeded( ROLLUP_FIVE_MINUTES, fiveSince );
+    rollup.seeded( ROLLUP_HOUR, hourSince );
+    rollup.seeded( ROLLUP_DAY, rollup.align( ROLLUP_DAY, hourSince ) + Rollup::width(ROLLUP_DAY) );
+
+    qDebug() << "Seeded rollup for device" << device << "from" << ( hours.length() + fives.length() ) << "rows";
 }
 
-void Controller::saveAverages()
+void Controller::clearAverages()
 {
-    if( !m_db.transaction() )
+    QHash< quint16, DeviceState >::iterator it;
+    for( it = m_state.begin(); it != m_state.end(); ++it )
     {
-        qWarning() << "Failed to open an averages transaction: " << m_db.lastError();
-        return;
+        for( int x=0; x < it.value().averages.size(); x++ )
+            it.value().averages[x].reset();
     }
+}
 
-    bool success = true;
-    foreach( quint16 reg, m_averages.keys() )
+void Controller::saveAverages()
+{
+    // Handed to the persistence thread, nothing here waits on the database.
+    // m_lastAverage is only the first poll in the bucket, the row covers all of it:
+    qint64 offset = m_lastAverage.offsetFromUtc() * 1000LL;
+    qint64 tstart = ( ( m_lastAverage.toMSecsSinceEpoch() + offset ) / 300000 ) * 300000 - offset;
+    qint64 tend = tstart + 300000;
+    foreach( quint16 device, m_devices )
     {
-        double min=0, max=0, avg=0;
-        QDateTime now = QDateTime::currentDateTime();
-
-        quint16 listLen = m_averages[reg].length();
-        for( quint16 x=0; x < listLen; x++ )
-        {
-            double val = m_averages[reg][x];
-            if( val < min || x == 0 ) min = val;
-            if( val > max || x == 0 ) max = val;
-            avg += ( val / listLen );
-        }
-
-        QSqlQuery query(m_db);
-        if( !query.prepare("INSERT INTO fiveMinute(register, min, max, average, tstart, tend)VALUES(?, ?, ?, ?, ?, ?)") )
-        {
-            success = false;
-            break;
-        }
-
-        query.addBindValue(reg);
-        query.addBindValue(min);
-        query.addBindValue(max);
-        query.addBindValue(avg);
-        query.addBindValue(m_lastAverage);
-        query.addBindValue(now);
-        if( !query.exec() )
+        const DeviceState &state = m_state[device];
+        for( int index=0; index < m_registers.count(); index++ )
         {
-            success = false;
-            break;
+            const Accumulator &acc = state.averages[index];
+            if( acc.count == 0 )
+                continue;
+
+            PersistJob job;
+            job.type = JOB_AVERAGE;
+            job.row.device = device;
+            job.row.reg = m_registers.at(index).reg;
+            job.row.min = acc.min;
+            job.row.max = acc.max;
+            job.row.average = acc.mean();
+            job.row.tstart = tstart;
+            job.row.tend = tend;
+            m_persist->submit(job);
         }
     }
+}
 
-    if( success )
-        m_db.commit();
-    else
+void Controller::addReadings(DeviceState &state)
+{
+    // Once full, the oldest row is overwritten:
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    state.readings.append(now);
+    for( int x=0; x < m_registers.count(); x++ )
     {
-        qWarning() << "Transaction failed: " << m_db.lastError();
-        m_db.rollback();
-        return;
+        if( !isFresh(state, x, now) )
+            continue;
+
+        int slot = m_registers.at(x).slot;
+        state.readings.set( slot, state.values[slot] );
     }
 }
 
-void Controller::addReadings()
+void Controller::compressHourly()
 {
-    QDateTime whence = QDateTime::currentDateTime();
-    foreach( quint16 reg, v_registers.keys() )
+    PersistJob job;
+    job.type = JOB_COMPRESS;
+    job.row.device = 0;
+    job.row.reg = 0;
+    job.row.min = job.row.max = job.row.average = 0;
+    job.row.tstart = job.row.tend = 0;
+    m_persist->submit(job);
+}
+
+void Controller::sendValues(quint16 device)
+{
+    DeviceState &state = m_state[device];
+
+    addAverages(device);
+    addReadings(state);
+
+#ifdef WEBSOCKET
+    // Who gets what, in which encoding. Only build the ones someone subscribed is going to get:
+    Audience full, deltas;
+    QHash< QString, Audience > filtered;
+    foreach( Connection *client, m_connections )
     {
-        QString key = v_registers[reg]["n"].toString();
-        QPair< QDateTime, qreal > reading;
+        if( !client->m_subscribed )
+            continue;
 
-        reading.first = whence;
-        reading.second = m_values[key].toReal();
+        if( client->m_delta )
+            deltas.add(client);
+        else if( !client->m_filter.isEmpty() )
+            filtered[ client->m_filter ].add(client);
+        else
+            full.add(client);
+    }
 
-        m_readings[reg].append(reading);
+    // Nobody to keep the delta stream or a subscription going for anymore:
+    if( deltas.isEmpty() )
+        state.delta.key = 0;
+    QHash< QString, Subscription >::iterator it = m_subscriptions.begin();
+    while( it != m_subscriptions.end() )
+    {
+        if( filtered.contains( it.key() ) )
+            ++it;
+        else
+            it = m_subscriptions.erase(it);
+    }
+    if( full.isEmpty() && deltas.isEmpty() && filtered.isEmpty() )
+        return;
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QVariantMap stale = staleNames(state, now);
+    QVector< qint32 > ages = staleAges(state, now);
+
+    if( !full.isEmpty() )
+    {
+        QByteArray json, frame;
+        if( full.wantJson() )
+            json = readingJson(device, stale);
+        if( full.wantBinary() )
+            frame = WireFormat::reading( device, now, state.values, ages );
+
+        broadcast( full, json, frame, device );
     }
+
+    if( !deltas.isEmpty() )
+        sendDelta( device, deltas, stale, ages, now );
+
+    // One frame per filter, however many share it:
+    for( QHash< QString, Audience >::const_iterator group = filtered.constBegin(); group != filtered.constEnd(); ++group )
+        sendFiltered( device, m_subscriptions[ group.key() ], group.value(), ages, now );
+#endif
 }
 
-void Controller::trimReadings()
+void Controller::storeRegister(DeviceState &state, int index, quint16 raw)
 {
-    foreach( quint16 key, m_readings.keys() )
+    const RegisterDescriptor &desc = m_registers.at(index);
+    state.words[index] = raw;
+
+    if( desc.role == SOLE )
     {
-        while( m_readings[key].length() > 8000 )
-            m_readings[key].removeFirst();
+        if( desc.scale != 0 )
+            state.values[desc.slot] = raw * desc.scale;
+        else
+            state.values[desc.slot] = raw;
+        return;
     }
+
+    // A half without its other half never makes a value:
+    if( desc.pair < 0 )
+        return;
+
+    // Only put a >16-bit value together once both halves are from this cycle,
+    // otherwise a rollover between two reads would tear it:
+    const RegisterPair &pair = m_registers.pair(desc.pair);
+    int other = desc.role == LOW ? pair.high : pair.low;
+    qint64 otherGood = state.health[other].lastGood;
+    if( otherGood <= 0 || otherGood < state.cycleStarted )
+        return;
+
+    quint32 combined = ( (quint32)state.words[pair.high] << 16 ) | state.words[pair.low];
+    if( pair.scale != 0 )
+        state.values[pair.slot] = combined * pair.scale;
+    else
+        state.values[pair.slot] = combined;
 }
 
-void Controller::mapBits()
+void Controller::batchesReady()
 {
-    union u_pair {
-        struct {
-                quint16 low;
-                quint16 high;
-        } hl;
-        quint32 u32;
-    };
+    ModbusWorker *worker = qobject_cast< ModbusWorker * >( sender() );
+    if( !worker )
+        return;
+
+    worker->rearm();
+
+    QElapsedTimer cost;
+    cost.start();
 
-    QMap<QString, quint32> lowHighs;
-    foreach( QString key, m_values.keys() )
+    RegisterBatch batch;
+    while( worker->takeBatch(batch) )
     {
-        bool exists = false;
-        union u_pair mapped;
-        QString nakedKey = key.mid( 0, key.length()-2 );
-        if( lowHighs.contains(nakedKey) )
-        {
-                mapped.u32 = lowHighs[nakedKey];
-                exists = true;
-        }
-        if( key.endsWith(":L") )
+        if( !m_state.contains(batch.device) )
+            continue;
+
+        DeviceState &state = m_state[batch.device];
+        if( batch.cycleEnd )
         {
-                quint16 lowValue = m_values[key].toInt();
-                mapped.hl.low = lowValue;
-                m_values.remove(key);
-                if( exists )
-                        m_values[nakedKey] = mapped.u32;
-                else
-                        lowHighs[nakedKey] = mapped.u32;
+            // Everything that could be read has been, transmit!
+            sendValues(batch.device);
+            state.cycleStarted = QDateTime::currentMSecsSinceEpoch();
+            m_cycleCount++;
+            continue;
         }
-        else if( key.endsWith(":H") )
+
+        // Fan the block back out, skipping any padding registers:
+        qint64 now = QDateTime::currentMSecsSinceEpoch();
+        for( int x=0; x < batch.count; x++ )
         {
-                quint16 highValue = m_values[key].toInt();
-                mapped.hl.high = highValue;
-                m_values.remove(key);
-                if( exists )
-                        m_values[nakedKey] = mapped.u32;
-                else
-                        lowHighs[nakedKey] = mapped.u32;
+            int index = m_registers.indexOf( batch.start + x );
+            if( index < 0 )
+                continue;
+
+            RegisterHealth &health = state.health[index];
+            health.retries += batch.retries;
+            if( !batch.ok )
+            {
+                health.failures++;
+                continue;
+            }
+
+            health.lastGood = now;
+            storeRegister( state, index, batch.values[x] );
         }
     }
+
+    m_cycleCost += cost.nsecsElapsed();
+    reportCost();
 }
 
-void Controller::compressHourly()
+void Controller::reportCost()
 {
-    QSqlQuery query(m_db);
+    if( m_costReportMS <= 0 || m_costReport.elapsed() < m_costReportMS || m_cycleCount == 0 )
+        return;
 
-    QString queryStr = QString("INSERT INTO hourly(register, min, max, average, tstart, tend) SELECT register, MIN(min) AS min, MAX(max) AS max, AVG(average) AS average, MIN(tstart) AS tstart, MAX(tend) AS tend FROM fiveMinute WHERE tstart < SUBTIME(CONCAT(MAKEDATE(YEAR(now()), DAYOFYEAR(now())),' ',MAKETIME(HOUR(now()),0,0)), '24:00:00.000000') GROUP BY YEAR(tstart), MONTH(tstart), DAY(tstart), HOUR(tstart), register");
-    query.exec(queryStr);
+    // Time spent turning batches into values and sending them out, per published cycle:
+    qDebug() << "Cycle cost: avg" << ( m_cycleCost / m_cycleCount / 1000 ) << "us over" << m_cycleCount << "cycles";
+    qDebug() << "History cache:" << m_cache.count() << "entries," << m_cache.bytes() << "bytes," << m_cache.hits() << "hits and" << m_cache.misses() << "misses so far";
+#ifdef WEBSOCKET
+    if( m_gzipStats.frames > 0 )
+        qDebug() << "Gzip, once per broadcast:" << m_gzipStats.summary();
+    m_gzipStats = CompressionStats();
+#endif
+    m_cycleCost = 0;
+    m_cycleCount = 0;
+    m_costReport.restart();
 }
 
-void Controller::trimForHourly()
+bool Controller::isFresh(const DeviceState &state, int index, qint64 now)
 {
-    QSqlQuery query(m_db);
+    // Read successfully since the last cycle was published?
+    qint64 lastGood = state.health[index].lastGood;
+    if( lastGood <= 0 )
+        return false;
+    if( lastGood >= state.cycleStarted )
+        return true;
+
+    // Slow registers are served from cache between refreshes, they're only
+    // stale once they're overdue:
+    int poll = m_registers.at(index).poll;
+    return poll > 0 && now - lastGood <= poll + m_deadline;
+}
+
+#ifdef WEBSOCKET
+void Controller::handleConnection(quint32 id, const QString &peer)
+{
+    qDebug() << "Websocket client" << id << "connected from" << peer;
 
-    QString queryStr = QString("DELETE FROM fiveMinute WHERE tstart < SUBTIME(now(), '24:00:00.000000')");
-    query.exec(queryStr);
+    Connection *conn = new Connection(this);
+    conn->m_id = id;
+    conn->m_compressed = false;
+    conn->m_binary = false;
+    conn->m_subscribed = false;
+    conn->m_delta = false;
+    m_connections.insert(id, conn);
 }
 
-void Controller::sendValues()
+void Controller::handleDisconnect(quint32 id)
 {
-    // Convert LOW/HIGH to m_value for >16-bit values:
-    mapBits();
+    Connection *conn = m_connections.take(id);
+    if( conn )
+        conn->deleteLater();
+}
 
-    addAverages();
-    trimReadings();
-    addReadings();
+void Controller::connectionStats(const QJsonArray &stats)
+{
+    m_connectionStats = stats;
+}
+
+void Controller::sendFrame(Connection *conn, const QByteArray &payload, bool binary)
+{
+    emit messageReady( conn->m_id, payload, binary, -1 );
+}
+
+void Controller::broadcast(const Audience &who, const QByteArray &json, const QByteArray &frame, int live)
+{
+    // Each encoding is gzipped once, for all of its clients. With a 'live'
+    // key, any frame of it still waiting for one of them is replaced:
+    if( !who.json.isEmpty() )
+        emit broadcastReady( who.json, json, false, live );
+    if( !who.compressedJson.isEmpty() )
+        emit broadcastReady( who.compressedJson, gzip(json), true, live );
+    if( !who.frame.isEmpty() )
+        emit broadcastReady( who.frame, frame, true, live );
+    if( !who.compressedFrame.isEmpty() )
+        emit broadcastReady( who.compressedFrame, gzip(frame), true, live );
+}
+
+QByteArray Controller::readingJson(quint16 device, const QVariantMap &stale, qint64 key)
+{
+    // Only now do the values become names and QVariants:
+    const DeviceState &state = m_state[device];
+    QVariantMap data;
+    for( int slot=0; slot < m_registers.slotCount(); slot++ )
+    {
+        if( !qIsNaN( state.values[slot] ) )
+            data[ m_registers.slotName(slot) ] = state.values[slot];
+    }
 
-#ifdef WEBSOCKET
     QVariantMap obj;
     obj["type"] = "reading";
-    obj["data"] = m_values;
-    QJsonDocument doc = QJsonDocument::fromVariant(obj);
-    QString asStr = QString( doc.toJson() );
-    //qDebug() << "Json: " << asStr;
+    obj["device"] = device;
+    if( key > 0 )
+        obj["key"] = key;
+    obj["data"] = data;
+    if( !stale.isEmpty() )
+        obj["stale"] = stale;
+    return QJsonDocument::fromVariant(obj).toJson(QJsonDocument::Compact);
+}
 
-    QByteArray binary;
-    foreach( Connection *client, m_connections )
+QVariantMap Controller::staleNames(const DeviceState &state, qint64 now, const QVector< int > &only)
+{
+    // Registers that missed this cycle, and how old their last good value is:
+    QVariantMap stale;
+    for( int x=0; x < m_registers.count(); x++ )
     {
-        if( !client->m_subscribed ) continue;
+        if( isFresh(state, x, now) )
+            continue;
+        if( !only.isEmpty() && !only.contains( m_registers.at(x).slot ) )
+            continue;
+
+        QString key = m_registers.at(x).name;
+        qint64 lastGood = state.health[x].lastGood;
+        qint64 age = lastGood > 0 ? now - lastGood : -1;
+        if( stale.contains(key) && ( age < 0 || stale[key].toLongLong() < 0 ) )
+            age = -1;
+        else if( stale.contains(key) )
+            age = qMax( age, stale[key].toLongLong() );
+        stale[key] = age;
+    }
+    return stale;
+}
 
-        if( client->m_compressed )
-        {
-            // Only compress if 1+ clients are using compression, and then cache it.
-            if( binary.isEmpty() )
-                binary = GZip::compress(asStr.toUtf8());
+QVector< qint32 > Controller::staleAges(const DeviceState &state, qint64 now)
+{
+    // The same, per slot: 0 if fresh, else the oldest age of its registers (-1 if never read):
+    QVector< qint32 > ages( m_registers.slotCount(), 0 );
+    for( int x=0; x < m_registers.count(); x++ )
+    {
+        if( isFresh(state, x, now) )
+            continue;
 
-            client->m_client->sendBinaryMessage( binary );
-        }
+        qint32 &age = ages[ m_registers.at(x).slot ];
+        qint64 lastGood = state.health[x].lastGood;
+        if( lastGood <= 0 || age < 0 )
+            age = -1;
         else
-            client->m_client->sendTextMessage(asStr);
+            age = qMax( age, (qint32)qBound( (qint64)1, now - lastGood, (qint64)INT_MAX ) );
     }
-#endif
+    return ages;
 }
 
-void Controller::timerTriggered()
+static bool moved(double from, double to, double deadband)
 {
-    if( l_registers.length() <= m_index )
-        return;
-
-    quint16 reg = l_registers[m_index];
-    //QVariantMap values = v_registers[reg];
-    //qDebug() << "Reading register: " << values["n"].toString();
-    m_epsolar->readRegister( reg );
+    if( qIsNaN(from) || qIsNaN(to) )
+        return qIsNaN(from) != qIsNaN(to);
+    return qAbs( to - from ) > deadband;
 }
 
-void Controller::registerReceived(quint16 reg, QVariantList values)
+void Controller::sendDelta(quint16 device, const Audience &who, const QVariantMap &stale, const QVector< qint32 > &ages, qint64 now)
 {
-    if( values.length() < 1 )
-        return;
+    DeviceState &state = m_state[device];
+    DeltaState &delta = state.delta;
 
-    QVariantMap ent = v_registers[reg];
-    QString regName = ent["n"].toString();
+    // Everyone starts over from a keyframe every so often. It's never superseded,
+    // and a delta for the previous one still waiting for a slow client goes:
+    if( delta.key == 0 || now - delta.key >= m_keyframeMS )
+    {
+        delta.key = now;
+        delta.values = state.values;
+        delta.dirty.fill( false, state.values.size() );
+        delta.stale = !stale.isEmpty();
+        delta.keyJson = readingJson(device, stale, now);
+        delta.keyFrame = WireFormat::reading( device, now, state.values, ages );
+        broadcast( who, delta.keyJson, delta.keyFrame, LIVE_KEYFRAME(device) );
+        return;
+    }
 
-    QVariant value = values[0];
-    if( ent.contains("scale") )
+    QVector< int > changed;
+    for( int slot=0; slot < state.values.size(); slot++ )
     {
-        double scale = ent["scale"].toDouble();
-        value = (double)(values[0].toInt() * scale);
+        if( !delta.dirty[slot] && moved( delta.values[slot], state.values[slot], m_deadbands[slot] ) )
+            delta.dirty[slot] = true;
+        if( delta.dirty[slot] )
+            changed.append(slot);
     }
-    if( ent.contains("lowhigh") )
+
+    // Quiet, and nothing stale to clear either:
+    if( changed.isEmpty() && stale.isEmpty() && !delta.stale )
+        return;
+    delta.stale = !stale.isEmpty();
+
+    QByteArray json, frame;
+    if( who.wantJson() )
     {
-        int lowhigh = ent["lowhigh"].toInt();
-        if( lowhigh == LOW )
-            regName.append(":L");
-        else
-            regName.append(":H");
+        QVariantMap data;
+        foreach( int slot, changed )
+            data[ m_registers.slotName(slot) ] = state.values[slot];
+
+        QVariantMap obj;
+        obj["type"] = "delta";
+        obj["device"] = device;
+        obj["key"] = delta.key;
+        obj["whence"] = now;
+        obj["data"] = data;
+        if( !stale.isEmpty() )
+            obj["stale"] = stale;
+        json = QJsonDocument::fromVariant(obj).toJson(QJsonDocument::Compact);
     }
-    m_values[regName] = value;
+    if( who.wantBinary() )
+        frame = WireFormat::delta( device, now, delta.key, state.values, changed, ages );
+
+    broadcast( who, json, frame, device );
+}
 
-    m_index++;
-    if( m_index >= l_registers.length() )
+void Controller::sendKeyframes(Connection *conn)
+{
+    // Joining a stream in between keyframes, the last one and the next delta bring it up to date.
+    // Otherwise the next cycle is a keyframe anyway:
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    foreach( quint16 device, m_devices )
     {
-        // All registers filled, transmit!
-        sendValues();
-        m_index = 0;
+        const DeltaState &delta = m_state[device].delta;
+        if( delta.key == 0 || now - delta.key >= m_keyframeMS )
+            continue;
+
+        QByteArray payload = conn->m_binary ? delta.keyFrame : delta.keyJson;
+        if( conn->m_compressed )
+            sendFrame( conn, gzip(payload), true );
+        else
+            sendFrame( conn, payload, conn->m_binary );
     }
 }
 
-#ifdef WEBSOCKET
-Connection *Controller::mapConnection( QWebSocket *socket )
+QString Controller::subscription(const QJsonObject &request)
 {
-    foreach( Connection *conn, m_connections )
-        if( conn->m_client == socket )
-            return conn;
-    return nullptr;
+    QVector< int > slotList;
+    foreach( const QJsonValue &reg, request.value("registers").toArray() )
+    {
+        int index = m_registers.indexOf( reg.toInt() );
+        if( index >= 0 && !slotList.contains( m_registers.at(index).slot ) )
+            slotList.append( m_registers.at(index).slot );
+    }
+
+    // Either an interval in ms or a maximum rate per second:
+    qint64 interval = qMax( (qint64)0, request.value("interval").toVariant().toLongLong() );
+    double rate = request.value("rate").toDouble();
+    if( rate > 0 )
+        interval = qMax( interval, (qint64)( 1000 / rate ) );
+    bool aggregate = request.value("aggregate").toBool();
+
+    // Everything, every cycle, as ever:
+    if( slotList.isEmpty() && interval == 0 && !aggregate )
+        return QString();
+
+    if( slotList.isEmpty() )
+    {
+        for( int slot=0; slot < m_registers.slotCount(); slot++ )
+            slotList.append(slot);
+    }
+    std::sort( slotList.begin(), slotList.end() );
+
+    QStringList names;
+    foreach( int slot, slotList )
+        names << QString::number(slot);
+    QString key = QString("%1|%2|%3").arg( names.join(",") ).arg(interval).arg(aggregate);
+
+    if( !m_subscriptions.contains(key) )
+    {
+        Subscription sub;
+        sub.slotList = slotList;
+        sub.interval = interval;
+        sub.aggregate = aggregate;
+        m_subscriptions.insert(key, sub);
+    }
+    return key;
 }
 
-void Controller::handleConnection(QWebSocket *socket)
+void Controller::sendFiltered(quint16 device, Subscription &sub, const Audience &who, const QVector< qint32 > &ages, qint64 now)
 {
-    connect( socket, &QWebSocket::textMessageReceived, this, &Controller::handlePacket );
-    connect( socket, &QWebSocket::disconnected, this, &Controller::handleDisconnect );
+    const DeviceState &state = m_state[device];
 
-    Connection *conn = new Connection(this);
-    conn->m_client = socket;
-    conn->m_compressed = false;
-    conn->m_subscribed = false;
-    m_connections.push_back(conn);
+    // Gathered every cycle, only fresh reads as for the averages:
+    QVector< Accumulator > &sums = sub.sums[device];
+    if( sub.aggregate )
+    {
+        sums.resize( sub.slotList.size() );
+        for( int x=0; x < sub.slotList.size(); x++ )
+        {
+            int slot = sub.slotList[x];
+            if( ages[slot] == 0 && !qIsNaN( state.values[slot] ) )
+                sums[x].add( state.values[slot] );
+        }
+    }
+
+    // Keeps to its cadence, unless it fell more than an interval behind:
+    qint64 &due = sub.due[device];
+    if( sub.aggregate && !sub.since.contains(device) )
+    {
+        // The first window starts now, there's nothing to summarise yet:
+        sub.since[device] = now;
+        due = now + sub.interval;
+    }
+    if( now < due )
+        return;
+    due = due > 0 && now - due < sub.interval ? due + sub.interval : now + sub.interval;
+
+    qint64 from = sub.since.value(device, now);
+    sub.since[device] = now;
+
+    QByteArray json, frame;
+    if( who.wantJson() )
+    {
+        QVariantMap data;
+        for( int x=0; x < sub.slotList.size(); x++ )
+        {
+            int slot = sub.slotList[x];
+            if( sub.aggregate && sums[x].count > 0 )
+            {
+                QVariantMap entry;
+                entry["min"] = sums[x].min;
+                entry["max"] = sums[x].max;
+                entry["avg"] = sums[x].mean();
+                data[ m_registers.slotName(slot) ] = entry;
+            }
+            else if( !sub.aggregate && !qIsNaN( state.values[slot] ) )
+                data[ m_registers.slotName(slot) ] = state.values[slot];
+        }
+
+        QVariantMap obj;
+        obj["type"] = sub.aggregate ? "aggregate" : "reading";
+        obj["device"] = device;
+        if( sub.aggregate )
+        {
+            obj["from"] = from;
+            obj["to"] = now;
+        }
+        obj["data"] = data;
+        QVariantMap stale = staleNames(state, now, sub.slotList);
+        if( !stale.isEmpty() )
+            obj["stale"] = stale;
+        json = QJsonDocument::fromVariant(obj).toJson(QJsonDocument::Compact);
+    }
+    if( who.wantBinary() )
+    {
+        if( sub.aggregate )
+            frame = WireFormat::summary( device, from, now, sub.slotList, sums );
+        else
+        {
+            QVector< qint32 > filteredAges( ages.size(), 0 );
+            foreach( int slot, sub.slotList )
+                filteredAges[slot] = ages[slot];
+            frame = WireFormat::delta( device, now, 0, state.values, sub.slotList, filteredAges );
+        }
+    }
+
+    if( sub.aggregate )
+    {
+        for( int x=0; x < sums.size(); x++ )
+            sums[x].reset();
+    }
+
+    broadcast( who, json, frame, device );
 }
 
-void Controller::handleDisconnect()
+QByteArray Controller::gzip(const QByteArray &payload)
 {
-    QWebSocket *socket = qobject_cast< QWebSocket * >( sender() );
-    Connection *conn = mapConnection(socket);
-    if( conn )
-        m_connections.removeOne( conn );
-    socket->deleteLater();
+    // The legacy "compress" flag, a fresh gzip stream every message:
+    QElapsedTimer cost;
+    cost.start();
+    QByteArray compressed = GZip::compress(payload);
+    m_gzipStats.add( payload.size(), compressed.size(), cost.nsecsElapsed() );
+    return compressed;
 }
 
-void Controller::handlePacket(const QString &message)
+void Controller::handlePacket(quint32 id, const QString &message)
 {
-    QWebSocket *socket = qobject_cast< QWebSocket * >( sender() );
-    Connection *conn = mapConnection(socket);
+    // Gone already?
+    Connection *conn = m_connections.value(id);
     if( !conn )
-    {
-        socket->deleteLater();
         return;
-    }
 
     QJsonDocument doc = QJsonDocument::fromJson(message.toUtf8());
 
@@ -399,13 +982,29 @@ void Controller::handlePacket(const QString &message)
     if( obj.contains("compress") )
         conn->m_compressed = obj.value("compress").toBool();
 
+    // Binary frames from now on, after the schema they refer to:
+    if( obj.contains("binary") )
+    {
+        bool binary = obj.value("binary").toBool();
+        if( binary && !conn->m_binary )
+            sendSchema(conn);
+        conn->m_binary = binary;
+    }
+
+    quint16 device = m_devices.isEmpty() ? 1 : m_devices.first();
+    if( obj.contains("device") )
+        device = obj.value("device").toInt();
+
+    // Thin the whole range down to 'count' points per register instead of cutting it off:
+    int downsample = Downsample::mode( obj.value("downsample").toString() );
+
     if( obj.value("action").toString() == "latest" )
     {
         quint32 count = 1000;
         if( obj.contains("count") )
             count = obj.value("count").toInt(1000);
 
-        return sendLatest(socket, count);
+        return sendLatest(conn, device, count, downsample);
     }
     else if( obj.value("action").toString() == "averages" )
     {
@@ -423,7 +1022,7 @@ void Controller::handlePacket(const QString &message)
         QDateTime from = QDateTime::fromMSecsSinceEpoch( obj.value("from").toVariant().toULongLong() );
         QDateTime to = QDateTime::fromMSecsSinceEpoch( obj.value("to").toVariant().toULongLong() );
 
-        return sendAverages(socket, from, to, reg, count);
+        return sendAverages(conn, device, from, to, reg, count, downsample);
     }
     else if( obj.value("action").toString() == "hourly" )
     {
@@ -441,7 +1040,33 @@ void Controller::handlePacket(const QString &message)
         QDateTime from = QDateTime::fromMSecsSinceEpoch( obj.value("from").toVariant().toULongLong() );
         QDateTime to = QDateTime::fromMSecsSinceEpoch( obj.value("to").toVariant().toULongLong() );
 
-        return sendHourly(socket, from, to, reg, count);
+        return sendHourly(conn, device, from, to, reg, count, downsample);
+    }
+    else if( obj.value("action").toString() == "daily" || obj.value("action").toString() == "monthly" )
+    {
+        quint32 count = 1000;
+        if( obj.contains("count") )
+            count = obj.value("count").toInt(1000);
+
+        quint16 reg = 0;
+        if( obj.contains("register") )
+            reg = obj.value("register").toInt();
+
+        if( !obj.contains("from") ||!obj.contains("to") )
+            return;
+
+        QDateTime from = QDateTime::fromMSecsSinceEpoch( obj.value("from").toVariant().toULongLong() );
+        QDateTime to = QDateTime::fromMSecsSinceEpoch( obj.value("to").toVariant().toULongLong() );
+
+        return sendCalendar(conn, obj.value("action").toString(), device, from, to, reg, count);
+    }
+    else if( obj.value("action").toString() == "history" )
+    {
+        return sendHistory(conn, device, obj);
+    }
+    else if( obj.value("action").toString() == "status" )
+    {
+        return sendStatus(conn);
     }
     else if( obj.value("action").toString() == "subscribe" )
     {
@@ -450,216 +1075,483 @@ void Controller::handlePacket(const QString &message)
             onoff = obj.value("subscribe").toBool();
 
         conn->m_subscribed = onoff;
+        conn->m_delta = obj.value("delta").toBool();
+        conn->m_filter = onoff && !conn->m_delta ? subscription(obj) : QString();
+        if( onoff && conn->m_delta )
+            sendKeyframes(conn);
     }
 }
 
-void Controller::sendAverages(QWebSocket *socket, const QDateTime &from, const QDateTime &to, quint16 reg, quint32 count)
+void Controller::sendAverages(Connection *conn, quint16 device, const QDateTime &from, const QDateTime &to, quint16 reg, quint32 count, int downsample)
 {
-    Connection *conn = mapConnection(socket);
-    if( !conn )
+    sendTier(conn, "averages", TIER_FIVE_MINUTES, device, from, to, reg, count, downsample);
+}
+
+void Controller::sendHourly(Connection *conn, quint16 device, const QDateTime &from, const QDateTime &to, quint16 reg, quint32 count, int downsample)
+{
+    sendTier(conn, "hourly", TIER_HOUR, device, from, to, reg, count, downsample);
+}
+
+void Controller::sendCalendar(Connection *conn, const QString &table, quint16 device, const QDateTime &from, const QDateTime &to, quint16 reg, quint32 count)
+{
+    // Only ever one of the two tiers, never whatever the client sent:
+    if( table == "monthly" )
+        sendTier(conn, "monthly", TIER_MONTH, device, from, to, reg, count, DOWNSAMPLE_NONE);
+    else
+        sendTier(conn, "daily", TIER_DAY, device, from, to, reg, count, DOWNSAMPLE_NONE);
+}
+
+void Controller::sendTier(Connection *conn, const QString &type, int tier, quint16 device, const QDateTime &from, const QDateTime &to, quint16 reg, quint32 count, int downsample)
+{
+    HistorySpan span = alignSpan(tier, from, to);
+    QString key = QString("%1|%2|%3|%4|%5|%6|%7").arg(type).arg(device).arg(reg).arg(span.from).arg(span.to).arg(count).arg(downsample);
+
+    sendCached( conn, key, QVector< HistorySpan >() << span, [=]( bool binary ) {
+        QList< HistoryRow > rows = loadHistory( tier, device, QDateTime::fromMSecsSinceEpoch(span.from), QDateTime::fromMSecsSinceEpoch(span.to), registerList(reg), count, downsample );
+        if( binary )
+        {
+            WireSection section;
+            section.tier = tier;
+            section.rows = rows;
+            return WireFormat::history( device, QList< WireSection >() << section );
+        }
+
+        QJsonObject pkt;
+        pkt.insert("type", QJsonValue(type));
+        pkt.insert("device", device);
+        pkt.insert("data", QJsonValue( historyJson(tier, rows) ));
+        return QJsonDocument(pkt).toJson(QJsonDocument::Compact);
+    } );
+}
+
+void Controller::sendHistory(Connection *conn, quint16 device, const QJsonObject &request)
+{
+    QList< quint16 > regs;
+    foreach( const QJsonValue &reg, request.value("registers").toArray() )
     {
-        socket->deleteLater();
-        return;
+        if( !regs.contains( reg.toInt() ) )
+            regs.append( reg.toInt() );
+    }
+    std::sort( regs.begin(), regs.end() );
+
+    // Each tier is a name, or an object naming it and overriding the request's range, count and downsampling:
+    static const char *names[TIER_COUNT] = { "averages", "hourly", "daily", "monthly" };
+    QStringList tierNames;
+    QVector< HistorySpan > spans;
+    QList< quint32 > counts;
+    QList< int > modes;
+    foreach( const QJsonValue &value, request.value("tiers").toArray() )
+    {
+        QJsonObject spec = value.isObject() ? value.toObject() : QJsonObject();
+        QString name = value.isObject() ? spec.value("name").toString() : value.toString();
+
+        int tier = 0;
+        while( tier < TIER_COUNT && name != names[tier] )
+            tier++;
+        if( tier == TIER_COUNT || tierNames.contains(name) )
+            continue;
+
+        QJsonValue from = spec.contains("from") ? spec.value("from") : request.value("from");
+        QJsonValue to = spec.contains("to") ? spec.value("to") : request.value("to");
+        if( from.isUndefined() || to.isUndefined() )
+            continue;
+
+        tierNames.append(name);
+        spans.append( alignSpan( tier, QDateTime::fromMSecsSinceEpoch( from.toVariant().toULongLong() ), QDateTime::fromMSecsSinceEpoch( to.toVariant().toULongLong() ) ) );
+        counts.append( ( spec.contains("count") ? spec.value("count") : request.value("count") ).toInt(1000) );
+        modes.append( Downsample::mode( ( spec.contains("downsample") ? spec.value("downsample") : request.value("downsample") ).toString() ) );
     }
 
-    QJsonObject obj = loadAverages(from, to, reg, count);
-    QJsonObject pkt;
-    pkt.insert("type", QJsonValue("averages"));
-    pkt.insert("data", QJsonValue(obj));
-    QJsonDocument doc = QJsonDocument( pkt );
-    QString asStr = QString( doc.toJson() );
-    //qDebug() << "Json: " << asStr;
+    QStringList key;
+    key << "history" << QString::number(device);
+    foreach( quint16 reg, regs )
+        key << QString::number(reg);
+    for( int x=0; x < spans.size(); x++ )
+        key << QString("%1:%2:%3:%4:%5").arg(spans[x].tier).arg(spans[x].from).arg(spans[x].to).arg(counts[x]).arg(modes[x]);
+
+    sendCached( conn, key.join("|"), spans, [=]( bool binary ) {
+        // One read per tier for all the registers:
+        QList< WireSection > sections;
+        QJsonObject data;
+        for( int x=0; x < spans.size(); x++ )
+        {
+            WireSection section;
+            section.tier = spans[x].tier;
+            section.rows = loadHistory( spans[x].tier, device, QDateTime::fromMSecsSinceEpoch(spans[x].from), QDateTime::fromMSecsSinceEpoch(spans[x].to), regs, counts[x], modes[x], true );
+            if( binary )
+                sections.append(section);
+            else
+                data.insert( tierNames[x], historyJson(section.tier, section.rows) );
+        }
 
-    if( conn->m_compressed )
-        socket->sendBinaryMessage( GZip::compress(asStr.toUtf8()) );
-    else
-        socket->sendTextMessage(asStr);
+        if( binary )
+            return WireFormat::history(device, sections);
+
+        QJsonObject pkt;
+        pkt.insert("type", QJsonValue("history"));
+        pkt.insert("device", device);
+        pkt.insert("data", QJsonValue(data));
+        return QJsonDocument(pkt).toJson(QJsonDocument::Compact);
+    } );
 }
 
-void Controller::sendHourly(QWebSocket *socket, const QDateTime &from, const QDateTime &to, quint16 reg, quint32 count)
+void Controller::sendCached(Connection *conn, const QString &key, const QVector< HistorySpan > &spans, std::function< QByteArray( bool binary ) > build)
 {
-    Connection *conn = mapConnection(socket);
-    if( !conn )
+    // Requests are answered one at a time on this thread, so the first of a
+    // burst of identical ones builds it and the rest find it here:
+    QString full = key + ( conn->m_binary ? "|bin" : "|json" ) + ( conn->m_compressed ? "|gz" : "" );
+    QByteArray payload;
+    if( !m_cache.lookup(full, payload) )
     {
-        socket->deleteLater();
-        return;
+        payload = build( conn->m_binary );
+        if( conn->m_compressed )
+            payload = GZip::compress(payload);
+        m_cache.insert(full, payload, spans);
     }
 
-    QJsonObject obj = loadHourly(from, to, reg, count);
+    sendFrame( conn, payload, conn->m_compressed || conn->m_binary );
+}
+
+void Controller::sendSchema(Connection *conn)
+{
+    // What the binary frames leave out: which register and slot is which.
+    QJsonArray registers;
+    for( int x=0; x < m_registers.count(); x++ )
+    {
+        const RegisterDescriptor &desc = m_registers.at(x);
+
+        QJsonObject entry;
+        entry.insert("register", desc.reg);
+        entry.insert("name", desc.name);
+        entry.insert("unit", desc.measure);
+        entry.insert("scale", desc.scale);
+        entry.insert("slot", desc.slot);
+        registers.append(entry);
+    }
+
+    QJsonArray slotNames;
+    for( int slot=0; slot < m_registers.slotCount(); slot++ )
+        slotNames.append( m_registers.slotName(slot) );
+
+    QJsonArray devices;
+    foreach( quint16 id, m_devices )
+        devices.append(id);
+
     QJsonObject pkt;
-    pkt.insert("type", QJsonValue("hourly"));
-    pkt.insert("data", QJsonValue(obj));
-    QJsonDocument doc = QJsonDocument( pkt );
-    QString asStr = QString( doc.toJson() );
-    //qDebug() << "Json: " << asStr;
+    pkt.insert("type", QJsonValue("schema"));
+    pkt.insert("version", WIRE_VERSION);
+    pkt.insert("registers", registers);
+    pkt.insert("slots", slotNames);
+    pkt.insert("devices", devices);
 
-    if( conn->m_compressed )
-        socket->sendBinaryMessage( GZip::compress(asStr.toUtf8()) );
-    else
-        socket->sendTextMessage(asStr);
+    sendFrame( conn, QJsonDocument(pkt).toJson(QJsonDocument::Compact), false );
 }
 
-void Controller::sendLatest(QWebSocket *socket, quint32 count)
+HistorySpan Controller::alignSpan(int tier, const QDateTime &from, const QDateTime &to) const
 {
-    Connection *conn = mapConnection(socket);
-    if( !conn )
+    // Whole buckets on the local clock, so refreshes a few seconds apart
+    // share an answer. Months go by days, they aren't all the same length:
+    static const qint64 widths[TIER_COUNT] = { 300000LL, 3600000LL, 86400000LL, 86400000LL };
+    qint64 width = widths[tier];
+    qint64 offset = QDateTime::currentDateTime().offsetFromUtc() * 1000LL;
+
+    HistorySpan span;
+    span.tier = tier;
+    span.from = ( ( from.toMSecsSinceEpoch() + offset ) / width ) * width - offset;
+    span.to = ( ( to.toMSecsSinceEpoch() + offset + width - 1 ) / width ) * width - offset;
+    return span;
+}
+
+void Controller::sendLatest(Connection *conn, quint16 device, quint32 count, int downsample)
+{
+    QList< WireSeries > series = loadReadings(device, count, downsample);
+    QByteArray payload;
+    if( conn->m_binary )
+        payload = WireFormat::latest(device, series);
+    else
     {
-        socket->deleteLater();
-        return;
+        QJsonObject pkt;
+        pkt.insert("type", QJsonValue("latest"));
+        pkt.insert("device", device);
+        pkt.insert("data", QJsonValue( readingsJson(series) ));
+        payload = QJsonDocument(pkt).toJson(QJsonDocument::Compact);
     }
 
-    QJsonObject obj = loadReadings(count);
+    if( conn->m_compressed )
+        payload = GZip::compress(payload);
+    sendFrame( conn, payload, conn->m_compressed || conn->m_binary );
+}
+
+void Controller::sendStatus(Connection *conn)
+{
+    QJsonObject obj = loadStatus();
     QJsonObject pkt;
-    pkt.insert("type", QJsonValue("latest"));
+    pkt.insert("type", QJsonValue("status"));
     pkt.insert("data", QJsonValue(obj));
-    QJsonDocument doc = QJsonDocument( pkt );
-    QString asStr = QString( doc.toJson() );
-    //qDebug() << "Json: " << asStr;
+    pkt.insert("connections", QJsonValue( m_connectionStats ));
+    QByteArray json = QJsonDocument(pkt).toJson(QJsonDocument::Compact);
 
     if( conn->m_compressed )
-        socket->sendBinaryMessage( GZip::compress(asStr.toUtf8()) );
+        sendFrame( conn, GZip::compress(json), true );
     else
-        socket->sendTextMessage(asStr);
+        sendFrame( conn, json, false );
 }
 
-QJsonObject Controller::loadHourly(const QDateTime &from, const QDateTime &to, quint16 reg, quint32 count)
+QJsonObject Controller::loadStatus()
 {
     QJsonObject jsmap;
-    quint32 limit = 8000;
-    if( count < limit )
-        limit = count;
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
 
-    QSqlQuery query(m_db);
-    QString args;
-    if( reg > 0 )
-        args = " AND register=" + QString::number(reg);
-
-    QString queryStr = QString("SELECT register, min, max, average, DATE(tstart) AS `date`, HOUR(tstart) AS `hour` FROM hourly WHERE tstart >= ? AND tend <= ? %1 ORDER BY register, tstart LIMIT ?").arg(args);
-    if( !query.prepare(queryStr) )
+    foreach( quint16 device, m_devices )
     {
-        return jsmap;
+        QJsonObject devmap;
+        const DeviceState &state = m_state[device];
+        for( int x=0; x < m_registers.count(); x++ )
+        {
+            const RegisterHealth &health = state.health[x];
+
+            QJsonObject entry;
+            entry.insert("name", m_registers.at(x).name);
+            entry.insert("failures", (qint64)health.failures);
+            entry.insert("retries", (qint64)health.retries);
+            entry.insert("age", health.lastGood > 0 ? now - health.lastGood : -1);
+            entry.insert("stale", !isFresh(state, x, now));
+
+            devmap.insert( QString::number(m_registers.at(x).reg), entry );
+        }
+
+        jsmap.insert( QString::number(device), devmap );
     }
 
-    query.addBindValue(from);
-    query.addBindValue(to);
-    query.addBindValue(limit);
-    if( !query.exec() )
+    return jsmap;
+}
+
+bool Controller::loadRollup(QList< HistoryRow > &rows, quint16 device, int level, const QDateTime &from, const QDateTime &to, const QList< quint16 > &regs, quint32 count)
+{
+    if( !m_state.contains(device) )
+        return false;
+
+    const Rollup &rollup = m_state[device].rollup;
+    if( !rollup.covers( level, from.toMSecsSinceEpoch() ) )
+        return false;
+
+    // Same order, and the same overall limit, as the history store:
+    QList< int > indexes;
+    for( int x=0; x < m_registers.count(); x++ )
     {
-        return jsmap;
+        if( regs.isEmpty() || regs.contains( m_registers.at(x).reg ) )
+            indexes.append(x);
     }
+    std::sort( indexes.begin(), indexes.end(), [this]( int a, int b ) {
+        return m_registers.at(a).reg < m_registers.at(b).reg;
+    } );
+
+    // Only closed buckets, the store doesn't have the open one yet either:
+    qint64 width = Rollup::width(level);
+    qint64 end = qMin( to.toMSecsSinceEpoch(), QDateTime::currentMSecsSinceEpoch() );
+    quint32 found = 0;
+    foreach( int index, indexes )
+    {
+        const RollupSeries &series = rollup.series(level, index);
+        for( int x=series.lowerBound( from.toMSecsSinceEpoch() ); x < series.size() && found < count; x++ )
+        {
+            const RollupBucket &bucket = series.at(x);
+            if( bucket.start + width > end )
+                break;
+
+            HistoryRow row;
+            row.device = device;
+            row.reg = m_registers.at(index).reg;
+            row.min = bucket.min;
+            row.max = bucket.max;
+            row.average = bucket.mean();
+            row.tstart = bucket.start;
+            row.tend = bucket.start + width;
+            rows.append(row);
+            found++;
+        }
+    }
+
+    return true;
+}
+
+QList< HistoryRow > Controller::loadRows(int tier, quint16 device, const QDateTime &from, const QDateTime &to, const QList< quint16 > &regs, quint32 limit)
+{
+    QList< HistoryRow > rows;
+
+    // Recent enough to still be in memory? Months are few enough to always query:
+    static const int levels[TIER_COUNT] = { ROLLUP_FIVE_MINUTES, ROLLUP_HOUR, ROLLUP_DAY, -1 };
+    if( levels[tier] >= 0 && loadRollup(rows, device, levels[tier], from, to, regs, limit) )
+        return rows;
+
+    if( !historyReady() )
+        return rows;
+
+    return m_history->read( tier, device, from.toMSecsSinceEpoch(), to.toMSecsSinceEpoch(), regs, limit );
+}
+
+QList< HistoryRow > Controller::loadHistory(int tier, quint16 device, const QDateTime &from, const QDateTime &to, const QList< quint16 > &regs, quint32 count, int downsample, bool perRegister)
+{
+    // 'count' caps the whole answer unless it's per register. Downsampling
+    // needs the whole range, not just its first rows:
+    quint32 limit = 8000;
+    if( count < limit )
+        limit = count;
+    if( perRegister )
+        limit = qMin( (quint64)count * ( regs.isEmpty() ? m_registers.count() : regs.length() ), (quint64)DOWNSAMPLE_MAX_ROWS );
+    if( downsample != DOWNSAMPLE_NONE )
+        limit = DOWNSAMPLE_MAX_ROWS;
 
+    return Downsample::history( loadRows(tier, device, from, to, regs, limit), downsample, count );
+}
+
+QJsonObject Controller::historyJson(int tier, const QList< HistoryRow > &rows)
+{
     QMap< quint16, QJsonArray > ents;
-    while( query.next() )
+    foreach( const HistoryRow &row, rows )
     {
-        quint16 reg = query.value(0).toInt();
-        qreal min = query.value(1).toReal();
-        qreal max = query.value(2).toReal();
-        qreal avg = query.value(3).toReal();
-        QString date = query.value(4).toString();
-        quint8 hour = query.value(5).toInt();
-
         QJsonObject entry;
-        entry.insert("min", min);
-        entry.insert("max", max);
-        entry.insert("avg", avg);
-        entry.insert("date", date);
-        entry.insert("hour", hour);
+        entry.insert("min", row.min);
+        entry.insert("max", row.max);
+        entry.insert("avg", row.average);
 
-        ents[ reg ].append(QJsonValue(entry));
+        // Shaped as the tables used to hand them out:
+        QDateTime start = QDateTime::fromMSecsSinceEpoch(row.tstart);
+        if( tier == TIER_FIVE_MINUTES )
+        {
+            entry.insert("start", row.tstart);
+            entry.insert("end", row.tend);
+        }
+        else
+            entry.insert("date", start.date().toString(Qt::ISODate));
+        if( tier == TIER_HOUR )
+            entry.insert("hour", start.time().hour());
+
+        ents[ row.reg ].append(QJsonValue(entry));
     }
 
+    QJsonObject jsmap;
     foreach( quint16 reg, ents.keys() )
-    {
-        QVariantMap regent = v_registers[reg];
-        QString regName = regent["n"].toString();
-
-        jsmap.insert( regName, ents[reg] );
-    }
+        jsmap.insert( registerName(reg), ents[reg] );
 
     return jsmap;
 }
 
-QJsonObject Controller::loadReadings(quint32 count)
+QList< WireSeries > Controller::loadReadings(quint16 device, quint32 count, int downsample)
 {
-    QJsonObject jsmap;
+    QList< WireSeries > series;
 
-    foreach( quint16 reg, m_readings.keys() )
+    if( !m_state.contains(device) )
+        return series;
+
+    const DeviceState &state = m_state[device];
+    const ReadingRing &readings = state.readings;
+    for( int slot=0; slot < m_registers.slotCount(); slot++ )
     {
-        QJsonArray vallist;
-        quint32 rcount = m_readings[reg].count();
-        for( quint32 x=0; x < rcount && x < count; x++ )
+        if( downsample != DOWNSAMPLE_NONE )
         {
-            int pos = rcount - (x+1);
-            QPair< QDateTime, qreal > ent = m_readings[reg][pos];
-            QJsonObject pair;
-            pair.insert("whence", ent.first.toMSecsSinceEpoch());
-            pair.insert("value", ent.second);
-            vallist.prepend(QJsonValue(pair));
+            WireSeries sampled = sampleReadings(readings, slot, count, downsample);
+            if( !sampled.whence.isEmpty() )
+                series.append(sampled);
+            continue;
         }
 
-        QVariantMap regent = v_registers[reg];
-        QString regName = regent["n"].toString();
+        // Walk back to the oldest of the last 'count' readings of this slot:
+        int first = readings.size();
+        quint32 found = 0;
+        while( first > 0 && found < count )
+        {
+            first--;
+            if( !qIsNaN( readings.value(slot, first) ) )
+                found++;
+        }
+        if( found == 0 )
+            continue;
+
+        WireSeries latest;
+        latest.slot = slot;
+        for( int row=first; row < readings.size(); row++ )
+        {
+            float value = readings.value(slot, row);
+            if( qIsNaN(value) )
+                continue;
+
+            latest.whence.append( readings.whence(row) );
+            latest.values.append(value);
+        }
 
-        jsmap.insert( regName, vallist );
+        series.append(latest);
     }
 
-    return jsmap;
+    return series;
 }
 
-QJsonObject Controller::loadAverages(const QDateTime &from, const QDateTime &to, quint16 reg, quint32 count)
+WireSeries Controller::sampleReadings(const ReadingRing &readings, int slot, quint32 count, int downsample)
 {
-    QJsonObject jsmap;
-    quint32 limit = 8000;
-    if( count < limit )
-        limit = count;
-
-    QSqlQuery query(m_db);
-    QString args;
-    if( reg > 0 )
-        args = " AND register=" + QString::number(reg);
-
-    QString queryStr = QString("SELECT register, min, max, average, tstart, tend FROM fiveMinute WHERE tstart >= ? AND tend <= ? %1 ORDER BY register, tstart LIMIT ?").arg(args);
-    if( !query.prepare(queryStr) )
+    // Everything held for the slot, thinned to 'count' points across all of it:
+    QVector< int > rows;
+    QVector< qint64 > x;
+    QVector< double > y;
+    for( int row=0; row < readings.size(); row++ )
     {
-        return jsmap;
+        float value = readings.value(slot, row);
+        if( qIsNaN(value) )
+            continue;
+
+        rows.append(row);
+        x.append( readings.whence(row) );
+        y.append(value);
     }
 
-    query.addBindValue(from);
-    query.addBindValue(to);
-    query.addBindValue(limit);
-    if( !query.exec() )
+    WireSeries sampled;
+    sampled.slot = slot;
+    if( downsample == DOWNSAMPLE_LTTB )
     {
-        return jsmap;
+        foreach( int i, Downsample::lttb(x, y, count) )
+        {
+            sampled.whence.append( x[i] );
+            sampled.values.append( y[i] );
+        }
+        return sampled;
     }
 
-    QMap< quint16, QJsonArray > ents;
-    while( query.next() )
+    // One point per run, its mean with the extremes either side:
+    QVector< int > bounds = Downsample::runs(rows.size(), count);
+    for( int r=0; r + 1 < bounds.size() && !rows.isEmpty(); r++ )
     {
-        quint16 reg = query.value(0).toInt();
-        qreal min = query.value(1).toReal();
-        qreal max = query.value(2).toReal();
-        qreal avg = query.value(3).toReal();
-        QDateTime start = query.value(4).toDateTime();
-        QDateTime end = query.value(5).toDateTime();
-
-        QJsonObject entry;
-        entry.insert("min", min);
-        entry.insert("max", max);
-        entry.insert("avg", avg);
-        entry.insert("start", start.toMSecsSinceEpoch());
-        entry.insert("end", end.toMSecsSinceEpoch());
-
-        ents[ reg ].append(QJsonValue(entry));
+        Accumulator acc;
+        for( int i=bounds[r]; i < bounds[r + 1]; i++ )
+            acc.add( y[i] );
+
+        sampled.whence.append( x[ bounds[r] ] );
+        sampled.values.append( acc.mean() );
+        sampled.mins.append( acc.min );
+        sampled.maxs.append( acc.max );
     }
+    return sampled;
+}
 
-    foreach( quint16 reg, ents.keys() )
+QJsonObject Controller::readingsJson(const QList< WireSeries > &series)
+{
+    QJsonObject jsmap;
+    foreach( const WireSeries &one, series )
     {
-        QVariantMap regent = v_registers[reg];
-        QString regName = regent["n"].toString();
+        QJsonArray vallist;
+        for( int x=0; x < one.whence.size(); x++ )
+        {
+            QJsonObject pair;
+            pair.insert("whence", one.whence[x]);
+            pair.insert("value", one.values[x]);
+            if( !one.mins.isEmpty() )
+            {
+                pair.insert("min", one.mins[x]);
+                pair.insert("max", one.maxs[x]);
+            }
+            vallist.append(QJsonValue(pair));
+        }
 
-        jsmap.insert( regName, ents[reg] );
+        jsmap.insert( m_registers.slotName(one.slot), vallist );
     }
-
     return jsmap;
 }
 
@@ -2,23 +2,39 @@
 #define CONTROLLER_H
 
 #include <QDateTime>
+#include <QElapsedTimer>
 #include <QObject>
 #include <QSettings>
+#include <QThread>
 #include <QVariantMap>
-#include <QTimer>
+#include <QVector>
+
+#include <functional>
 
 #ifdef WEBSOCKET
+#include <QJsonArray>
 #include <QJsonObject>
+
+#include "wsdeflate.h"
 #endif
 
 #include <QSqlDatabase>
 #include <QSqlError>
 #include <QSqlQuery>
 
-class Epsolar;
+#include "accumulator.h"
+#include "historystore.h"
+#include "readingring.h"
+#include "rollup.h"
+#include "registertable.h"
+#include "resultcache.h"
+#include "wireformat.h"
+
+class LagMonitor;
+class ModbusWorker;
+class PersistWorker;
 #ifdef WEBSOCKET
 class WebsocketServer;
-class QWebSocket;
 #endif
 
 class Connection : public QObject
@@ -28,70 +44,206 @@ class Connection : public QObject
 public:
     explicit Connection(QObject *parent = 0) : QObject(parent) {}
 
-    QWebSocket  *m_client;
+    quint32     m_id;           // The WebsocketServer's, for sending to it.
     bool        m_compressed;
+    bool        m_binary;       // WireFormat frames instead of JSON, once it's had the schema.
     bool        m_subscribed;
+    bool        m_delta;        // Keyframes and changes only, instead of every reading in full.
+    QString     m_filter;       // Key of its Subscription, empty for every register every cycle.
+};
+
+// Subscribers asking for the same registers at the same interval, who
+// share each frame and the values gathered for it:
+struct Subscription
+{
+    Subscription() : interval(0), aggregate(false) {}
+
+    QVector< int >      slotList;   // Sent, in slot order.
+    qint64              interval;   // ms, 0 for every cycle.
+    bool                aggregate;  // min/max/avg since the last one instead of the latest values.
+    QHash< quint16, qint64 > due;   // Per device, when it's next sent.
+    QHash< quint16, qint64 > since; // Per device, when the one before went.
+    QHash< quint16, QVector< Accumulator > > sums;  // Per device, by index into slotList.
+};
+
+// Subscribers of one stream, by the encoding they get it in:
+struct Audience
+{
+    QVector< quint32 >  json;
+    QVector< quint32 >  compressedJson;
+    QVector< quint32 >  frame;
+    QVector< quint32 >  compressedFrame;
+
+    void add(const Connection *conn)
+    {
+        if( conn->m_binary )
+            ( conn->m_compressed ? compressedFrame : frame ).append( conn->m_id );
+        else
+            ( conn->m_compressed ? compressedJson : json ).append( conn->m_id );
+    }
+
+    bool wantJson() const { return !json.isEmpty() || !compressedJson.isEmpty(); }
+    bool wantBinary() const { return !frame.isEmpty() || !compressedFrame.isEmpty(); }
+    bool isEmpty() const { return !wantJson() && !wantBinary(); }
+};
+
+struct RegisterHealth
+{
+    RegisterHealth() : failures(0), retries(0), lastGood(0) {}
+
+    quint32     failures;
+    quint32     retries;
+    qint64      lastGood;   // Epoch ms of the last successful read, 0 if never.
+};
+
+// The delta stream of one device, shared by all of its delta subscribers.
+// Each delta holds every slot that moved past its deadband since the last
+// keyframe, not just since the last delta, so any one of them brings a
+// client up to date and a slow client may skip some:
+struct DeltaState
+{
+    DeltaState() : key(0), stale(false) {}
+
+    qint64              key;        // Whence of the last keyframe, 0 if there's no stream going.
+    QVector< double >   values;     // Per slot, as of that keyframe.
+    QVector< bool >     dirty;      // Per slot, moved past its deadband since.
+    bool                stale;      // Whether the last frame sent had stale registers.
+    QByteArray          keyJson;    // The keyframe itself, for subscribers joining in between.
+    QByteArray          keyFrame;
+};
+
+struct DeviceState
+{
+    DeviceState() : cycleStarted(0) {}
+
+    QVector< double >   values;     // Per slot, NaN until first read.
+    QVector< quint16 >  words;      // Per register, as last read.
+    QVector< RegisterHealth > health;   // Per register.
+    qint64              cycleStarted;
+
+    QVector< Accumulator > averages;    // Per register, for the current five minute bucket.
+    ReadingRing         readings;   // One column per slot.
+    Rollup              rollup;     // Per register, at every resolution.
+    DeltaState          delta;
 };
 
 class Controller : public QObject
 {
     Q_OBJECT
 
-    QTimer          m_timer;
-    int             m_index;
-    QVariantMap     m_values;
+    // One worker thread per bus:
+    QList< QThread * >      m_modbusThreads;
+    QList< ModbusWorker * > m_workers;
+    LagMonitor      *m_lagMonitor;
+
+    QThread         *m_persistThread;
+    PersistWorker   *m_persist;
+
+    RegisterTable   m_registers;
+    QList< quint16 > m_devices;
+    QHash< quint16, DeviceState > m_state;  // By device ID.
+    int             m_deadline;
+    int             m_readingsCapacity;
+    QVector< int >  m_rollupBuckets;    // Buckets kept per rollup level.
+    QVector< double > m_deadbands;      // Per slot, for delta subscriptions.
+    qint64          m_keyframeMS;
+
+    // Per-cycle processing cost, reported alongside the event loop lag:
+    QElapsedTimer   m_costReport;
+    int             m_costReportMS;
+    qint64          m_cycleCost;    // ns
+    quint32         m_cycleCount;
 
     QDateTime       m_lastAverage;
-    QMap< quint16, QList< double > > m_averages;
-    QMap< quint16, QList< QPair< QDateTime, qreal > > > m_readings;
 
 #ifdef WEBSOCKET
-    QList< Connection * > m_connections;
+    QHash< quint32, Connection * > m_connections;  // By client ID.
+    QThread         *m_wssThread;
     WebsocketServer *m_wss;
+    QJsonArray      m_connectionStats;  // As last reported by m_wss.
+    CompressionStats m_gzipStats;       // "compress" readings, reported with the cycle cost.
+    QHash< QString, Subscription > m_subscriptions;    // By filter, while anyone's subscribed with it.
 #endif
 
-    Epsolar         *m_epsolar;
-    QSqlDatabase    m_db;
+    QSqlDatabase    m_db;       // Only for the registers table.
+    HistoryStore    *m_history;
+    ResultCache     m_cache;    // Finished history responses.
+    QElapsedTimer   m_databaseRetry;
+    int             m_databaseRetryMS;
+
+    bool historyReady();
 
-    bool loadRegisters();
-    void addRegister(quint16 reg, const QString &name, double scale=0, int lowhigh=0);
+    bool loadRegisters(QSettings *settings);
+    void loadDeadbands(QSettings *settings);
+    void storeRegister(DeviceState &state, int index, quint16 raw);
+    bool isFresh(const DeviceState &state, int index, qint64 now);
 
-    void addAverages();
+    void addAverages(quint16 device);
+    void seedRollup(quint16 device);
     void saveAverages();
     void clearAverages();
 
     void compressHourly();
-    void trimForHourly();
 
-    void sendValues();
-    void mapBits();
+    void sendValues(quint16 device);
 
-    void addReadings();
-    void trimReadings();
+    void addReadings(DeviceState &state);
+
+    QList< quint16 > registerList(quint16 reg) const;
+    QString registerName(quint16 reg) const;
+    void reportCost();
 
 #ifdef WEBSOCKET
-    Connection *mapConnection( QWebSocket *socket );
-
-    QJsonObject loadAverages(const QDateTime &from, const QDateTime &to, quint16 reg=0, quint32 count=120);
-    QJsonObject loadHourly(const QDateTime &from, const QDateTime &to, quint16 reg=0, quint32 count=120);
-    QJsonObject loadReadings(quint32 count=1000);
-    void sendAverages(QWebSocket *socket, const QDateTime &from, const QDateTime &to, quint16 reg=0, quint32 count=1000);
-    void sendHourly(QWebSocket *socket, const QDateTime &from, const QDateTime &to, quint16 reg=0, quint32 count=1000);
-    void sendLatest(QWebSocket *socket, quint32 count=1000);
+    void sendFrame(Connection *conn, const QByteArray &payload, bool binary);
+    void broadcast(const Audience &who, const QByteArray &json, const QByteArray &frame, int live);
+    QByteArray readingJson(quint16 device, const QVariantMap &stale, qint64 key=0);
+    QVariantMap staleNames(const DeviceState &state, qint64 now, const QVector< int > &only = QVector< int >());
+    QVector< qint32 > staleAges(const DeviceState &state, qint64 now);
+    void sendDelta(quint16 device, const Audience &who, const QVariantMap &stale, const QVector< qint32 > &ages, qint64 now);
+    void sendKeyframes(Connection *conn);
+    QString subscription(const QJsonObject &request);
+    void sendFiltered(quint16 device, Subscription &sub, const Audience &who, const QVector< qint32 > &ages, qint64 now);
+    QByteArray gzip(const QByteArray &payload);
+
+    bool loadRollup(QList< HistoryRow > &rows, quint16 device, int level, const QDateTime &from, const QDateTime &to, const QList< quint16 > &regs, quint32 count);
+    QList< HistoryRow > loadRows(int tier, quint16 device, const QDateTime &from, const QDateTime &to, const QList< quint16 > &regs, quint32 limit);
+    QList< HistoryRow > loadHistory(int tier, quint16 device, const QDateTime &from, const QDateTime &to, const QList< quint16 > &regs, quint32 count, int downsample, bool perRegister=false);
+    QJsonObject historyJson(int tier, const QList< HistoryRow > &rows);
+    QList< WireSeries > loadReadings(quint16 device, quint32 count=1000, int downsample=0);
+    WireSeries sampleReadings(const ReadingRing &readings, int slot, quint32 count, int downsample);
+    QJsonObject readingsJson(const QList< WireSeries > &series);
+    QJsonObject loadStatus();
+    void sendAverages(Connection *conn, quint16 device, const QDateTime &from, const QDateTime &to, quint16 reg=0, quint32 count=1000, int downsample=0);
+    void sendHourly(Connection *conn, quint16 device, const QDateTime &from, const QDateTime &to, quint16 reg=0, quint32 count=1000, int downsample=0);
+    void sendCalendar(Connection *conn, const QString &table, quint16 device, const QDateTime &from, const QDateTime &to, quint16 reg=0, quint32 count=1000);
+    void sendTier(Connection *conn, const QString &type, int tier, quint16 device, const QDateTime &from, const QDateTime &to, quint16 reg, quint32 count, int downsample);
+    void sendHistory(Connection *conn, quint16 device, const QJsonObject &request);
+    void sendCached(Connection *conn, const QString &key, const QVector< HistorySpan > &spans, std::function< QByteArray( bool binary ) > build);
+    void sendSchema(Connection *conn);
+    HistorySpan alignSpan(int tier, const QDateTime &from, const QDateTime &to) const;
+    void sendLatest(Connection *conn, quint16 device, quint32 count=1000, int downsample=0);
+    void sendStatus(Connection *conn);
 #endif
 public:
     explicit Controller(QSettings *settings, QObject *parent = 0);
+    ~Controller();
 
 signals:
+#ifdef WEBSOCKET
+    // To m_wss, which frames (and maybe deflates) each once:
+    void messageReady(quint32 id, const QByteArray &payload, bool binary, int live);
+    void broadcastReady(const QVector< quint32 > &ids, const QByteArray &payload, bool binary, int live);
+#endif
 
 private slots:
-    void timerTriggered();
+    void batchesReady();
+    void historyStored(int tier, qint64 from, qint64 to);
 #ifdef WEBSOCKET
-    void handleConnection( QWebSocket *socket );
-    void handleDisconnect();
-    void handlePacket(const QString &message);
+    void handleConnection(quint32 id, const QString &peer);
+    void handleDisconnect(quint32 id);
+    void handlePacket(quint32 id, const QString &message);
+    void connectionStats(const QJsonArray &stats);
 #endif
-    void registerReceived(quint16 register reg, QVariantList values);
 };
 
 #endif // CONTROLLER_H
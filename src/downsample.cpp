@@ -0,0 +1,144 @@
+#include "downsample.h"
+
+#include <QtMath>
+
+int Downsample::mode(const QString &name)
+{
+    if( name == "lttb" )
+        return DOWNSAMPLE_LTTB;
+    if( name == "minmax" )
+        return DOWNSAMPLE_MINMAX;
+    return DOWNSAMPLE_NONE;
+}
+
+QVector< int > Downsample::lttb(const QVector< qint64 > &x, const QVector< double > &y, int count)
+{
+    QVector< int > picked;
+    int size = x.size();
+    if( count >= size )
+    {
+        for( int i=0; i < size; i++ )
+            picked.append(i);
+        return picked;
+    }
+
+    // Too few for a triangle, just the ends:
+    if( count < 3 )
+    {
+        if( count > 0 )
+            picked.append(0);
+        if( count > 1 )
+            picked.append( size - 1 );
+        return picked;
+    }
+
+    // Relative to the first point, epoch ms lose precision as doubles squared:
+    qint64 origin = x[0];
+    double every = (double)( size - 2 ) / ( count - 2 );
+
+    picked.reserve(count);
+    picked.append(0);
+    int a = 0;
+    for( int i=0; i < count - 2; i++ )
+    {
+        // The average of the next bucket is the triangle's third corner:
+        int nextStart = (int)qFloor( ( i + 1 ) * every ) + 1;
+        int nextEnd = qMin( (int)qFloor( ( i + 2 ) * every ) + 1, size );
+        if( nextStart >= nextEnd )
+            nextStart = nextEnd - 1;
+        double avgX = 0, avgY = 0;
+        for( int j=nextStart; j < nextEnd; j++ )
+        {
+            avgX += x[j] - origin;
+            avgY += y[j];
+        }
+        avgX /= ( nextEnd - nextStart );
+        avgY /= ( nextEnd - nextStart );
+
+        // Whichever point of this bucket makes the largest triangle with the last pick:
+        int start = (int)qFloor( i * every ) + 1;
+        int end = (int)qFloor( ( i + 1 ) * every ) + 1;
+        double ax = x[a] - origin, ay = y[a];
+        double best = -1;
+        int pick = start;
+        for( int j=start; j < end; j++ )
+        {
+            double area = qAbs( ( ax - avgX ) * ( y[j] - ay ) - ( ax - ( x[j] - origin ) ) * ( avgY - ay ) );
+            if( area > best )
+            {
+                best = area;
+                pick = j;
+            }
+        }
+
+        picked.append(pick);
+        a = pick;
+    }
+    picked.append( size - 1 );
+
+    return picked;
+}
+
+QVector< int > Downsample::runs(int size, int count)
+{
+    QVector< int > bounds;
+    count = qMax( 1, qMin( count, size ) );
+    for( int i=0; i <= count; i++ )
+        bounds.append( (int)( (qint64)i * size / count ) );
+    return bounds;
+}
+
+QList< HistoryRow > Downsample::history(const QList< HistoryRow > &rows, int mode, int count)
+{
+    QList< HistoryRow > out;
+    for( int first=0; first < rows.length(); )
+    {
+        int last = first;
+        while( last < rows.length() && rows[last].reg == rows[first].reg && rows[last].device == rows[first].device )
+            last++;
+        int size = last - first;
+
+        if( mode == DOWNSAMPLE_NONE )
+        {
+            // Just the first of them:
+            for( int i=0; i < qMin( size, count ); i++ )
+                out.append( rows[first + i] );
+        }
+        else if( mode == DOWNSAMPLE_LTTB )
+        {
+            QVector< qint64 > x(size);
+            QVector< double > y(size);
+            for( int i=0; i < size; i++ )
+            {
+                x[i] = rows[first + i].tstart;
+                y[i] = rows[first + i].average;
+            }
+
+            foreach( int i, lttb(x, y, count) )
+                out.append( rows[first + i] );
+        }
+        else
+        {
+            // Each run becomes one row spanning it, keeping its extremes:
+            QVector< int > bounds = runs(size, count);
+            for( int r=0; r + 1 < bounds.size(); r++ )
+            {
+                HistoryRow merged = rows[ first + bounds[r] ];
+                double sum = 0;
+                for( int i=first + bounds[r]; i < first + bounds[r + 1]; i++ )
+                {
+                    merged.min = qMin( merged.min, rows[i].min );
+                    merged.max = qMax( merged.max, rows[i].max );
+                    merged.tend = qMax( merged.tend, rows[i].tend );
+                    sum += rows[i].average;
+                }
+                merged.average = sum / ( bounds[r + 1] - bounds[r] );
+                out.append(merged);
+            }
+        }
+
+        first = last;
+    }
+
+    return out;
+}
@@ -0,0 +1,37 @@
+#ifndef DOWNSAMPLE_H
+#define DOWNSAMPLE_H
+
+#include <QList>
+#include <QString>
+#include <QVector>
+
+#include "historystore.h"
+
+// How a long range is thinned to the requested number of points:
+#define DOWNSAMPLE_NONE 0       // First 'count' rows.
+#define DOWNSAMPLE_LTTB 1       // Largest-Triangle-Three-Buckets picks of the rows.
+#define DOWNSAMPLE_MINMAX 2     // Runs of rows merged into their min/max envelope.
+
+// Most rows read to downsample from, across all registers of a request:
+#define DOWNSAMPLE_MAX_ROWS 262144
+
+class Downsample
+{
+public:
+    // From the "downsample" field of a request:
+    static int mode(const QString &name);
+
+    // Indexes of 'count' points of the series that keep its visual shape,
+    // always including the first and last. All of them if there's no more.
+    static QVector< int > lttb(const QVector< qint64 > &x, const QVector< double > &y, int count);
+
+    // Start of each of 'count' runs splitting 'size' points as evenly as
+    // possible, plus 'size' at the end.
+    static QVector< int > runs(int size, int count);
+
+    // Rows of each register (grouped, as read from a store) down to at most
+    // 'count' each, spanning the whole range (or its start without a mode):
+    static QList< HistoryRow > history(const QList< HistoryRow > &rows, int mode, int count);
+};
+
+#endif // DOWNSAMPLE_H
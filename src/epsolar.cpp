@@ -2,10 +2,15 @@
 
 #include <QDebug>
 
-Epsolar::Epsolar(QObject *parent) : QObject(parent)
+Epsolar::Epsolar(QObject *parent) : QObject(parent),
+    m_timeout(1000),
+    m_timeouts(0)
 {
 #ifdef LIBMB
     m_ctx = NULL;
+    m_network = false;
+#else
+    m_client = nullptr;
 #endif
 }
 
@@ -19,9 +24,22 @@ Epsolar::~Epsolar()
 }
 
 #ifdef LIBMB
-bool Epsolar::open( const QString &portName, quint32 baud, int data, const QString &parity, int stop )
+void Epsolar::applyTimeout()
 {
     struct timeval tv;
+    tv.tv_sec = m_timeout / 1000;
+    tv.tv_usec = ( m_timeout % 1000 ) * 1000;
+#if (LIBMODBUS_VERSION_CHECK(3,1,2))
+    modbus_set_response_timeout(m_ctx, tv.tv_sec, tv.tv_usec);
+    modbus_set_byte_timeout(m_ctx, tv.tv_sec, tv.tv_usec);
+#else
+    modbus_set_response_timeout(m_ctx, &tv);
+    modbus_set_byte_timeout(m_ctx, &tv);
+#endif
+}
+
+bool Epsolar::open( const QString &portName, quint32 baud, int data, const QString &parity, int stop )
+{
     if( parity.length() < 1 )
     {
         return false;
@@ -35,15 +53,7 @@ bool Epsolar::open( const QString &portName, quint32 baud, int data, const QStri
     }
 
     modbus_set_slave(m_ctx, 1);
-    tv.tv_sec = 1;
-    tv.tv_usec = 0;
-#if (LIBMODBUS_VERSION_CHECK(3,1,2))
-    modbus_set_response_timeout(m_ctx, tv.tv_sec, tv.tv_usec);
-    modbus_set_byte_timeout(m_ctx, tv.tv_sec, tv.tv_usec);
-#else
-    modbus_set_response_timeout(m_ctx, &tv);
-    modbus_set_byte_timeout(m_ctx, &tv);
-#endif
+    applyTimeout();
 
     if( modbus_connect(m_ctx) == -1 )
     {
@@ -65,8 +75,10 @@ bool Epsolar::open( const QString &netAddr, int netPort )
         fprintf(stderr, "Unable to create the libmodbus context\n");
         return false;
     }
+    m_network = true;
 
     modbus_set_slave(m_ctx, 1);
+    applyTimeout();
 
     if( modbus_connect(m_ctx) == -1 )
     {
@@ -80,21 +92,54 @@ bool Epsolar::open( const QString &netAddr, int netPort )
     return true;
 }
 
-bool Epsolar::readRegister( qint32 req )
+void Epsolar::reconnect(int error)
+{
+    // Exceptions and garbled replies come from a device that's still there.
+    // A timeout on a serial bus is one device not answering, the port is fine:
+    if( error >= MODBUS_ENOBASE || ( error == ETIMEDOUT && !m_network ) )
+        return;
+
+    // At most once per timeout, however many requests fail in between:
+    if( m_reconnectClock.isValid() && m_reconnectClock.elapsed() < m_timeout )
+        return;
+
+    qDebug() << "MODBUS connection lost, reconnecting: " << modbus_strerror(error);
+    m_reconnectClock.start();
+    modbus_close(m_ctx);
+    if( modbus_connect(m_ctx) == -1 )
+        fprintf(stderr, "Reconnect failed: %s\n", modbus_strerror(errno));
+}
+
+bool Epsolar::readRegisters( quint32 tag, int slave, quint16 start, quint16 count )
 {
-    uint16_t res[64];
-    int ret = modbus_read_input_registers(m_ctx, req, 1, res);
+    if( m_ctx == NULL )
+        return false;
+
+    uint16_t res[MODBUS_MAX_READ_REGISTERS];
+    if( count > MODBUS_MAX_READ_REGISTERS )
+        count = MODBUS_MAX_READ_REGISTERS;
+
+    modbus_set_slave(m_ctx, slave);
+
+    int ret = modbus_read_input_registers(m_ctx, start, count, res);
     if( ret <= 0 )
     {
-        fprintf(stderr, "%s\n", modbus_strerror(errno));
-        return false;
+        int error = errno;
+        if( error == ETIMEDOUT )
+            m_timeouts++;
+        fprintf(stderr, "%s\n", modbus_strerror(error));
+        reconnect(error);
+
+        bool rejected = error == EMBXILFUN || error == EMBXILADD || error == EMBXILVAL;
+        emit registerError( tag, start, count, rejected );
+        return true;
     }
 
     QVariantList list;
     for( int x=0; x < ret; x++ )
         list.append( res[x] );
 
-    emit registerResult( req, list );
+    emit registerResult( tag, start, list );
     return true;
 }
 
@@ -167,30 +212,62 @@ bool Epsolar::open( const QString &portName, quint32 baud, int data, const QStri
         break;
     }
 
-    m_client.setConnectionParameter( QModbusClient::SerialPortNameParameter, portName );
-    m_client.setConnectionParameter( QModbusClient::SerialBaudRateParameter, baud );
-    m_client.setConnectionParameter( QModbusClient::SerialDataBitsParameter, db );
-    m_client.setConnectionParameter( QModbusClient::SerialParityParameter, p );
-    m_client.setConnectionParameter( QModbusClient::SerialStopBitsParameter, sb );
+    m_client = new QModbusRtuSerialMaster(this);
+    m_client->setConnectionParameter( QModbusClient::SerialPortNameParameter, portName );
+    m_client->setConnectionParameter( QModbusClient::SerialBaudRateParameter, baud );
+    m_client->setConnectionParameter( QModbusClient::SerialDataBitsParameter, db );
+    m_client->setConnectionParameter( QModbusClient::SerialParityParameter, p );
+    m_client->setConnectionParameter( QModbusClient::SerialStopBitsParameter, sb );
+
+    // Retries are up to the caller, so each one can be counted and the poll cycle deadline respected:
+    m_client->setTimeout( m_timeout );
+    m_client->setNumberOfRetries( 0 );
 
-    return m_client.connectDevice();
+    return m_client->connectDevice();
 }
 
 bool Epsolar::open( const QString &netAddr, int netPort )
 {
-    m_client.setConnectionParameter( QModbusClient::NetworkAddressParameter, netAddr );
-    m_client.setConnectionParameter( QModbusClient::NetworkPortParameter, netPort );
-    return m_client.connectDevice();
+    m_client = new QModbusTcpClient(this);
+    m_client->setConnectionParameter( QModbusClient::NetworkAddressParameter, netAddr );
+    m_client->setConnectionParameter( QModbusClient::NetworkPortParameter, netPort );
+    m_client->setTimeout( m_timeout );
+    m_client->setNumberOfRetries( 0 );
+    return m_client->connectDevice();
 }
 
-bool Epsolar::readRegister( qint32 req )
+bool Epsolar::readRegisters( quint32 tag, int slave, quint16 start, quint16 count )
 {
-    QModbusDataUnit rdu(QModbusDataUnit::InputRegisters, req, 1);
-    int sa = 1;
-    QModbusReply *reply = m_client.sendReadRequest( rdu, sa );
+    if( !m_client )
+        return false;
+
+    // Dropped (a gateway restarting, an adapter replugged)? Try again now and
+    // then, the requests in between fail as usual:
+    if( m_client->state() == QModbusDevice::UnconnectedState &&
+        ( !m_reconnectClock.isValid() || m_reconnectClock.elapsed() >= m_timeout ) )
+    {
+        qDebug() << "MODBUS device not connected, reconnecting: " << m_client->errorString();
+        m_reconnectClock.start();
+        m_client->connectDevice();
+    }
+    if( m_client->state() != QModbusDevice::ConnectedState )
+        return false;
+
+    QModbusDataUnit rdu(QModbusDataUnit::InputRegisters, start, count);
+    QModbusReply *reply = m_client->sendReadRequest( rdu, slave );
     if( !reply )
         return false;
 
+    // Remember what was asked for, a failed reply carries no data unit:
+    reply->setProperty("tag", tag);
+    reply->setProperty("start", start);
+    reply->setProperty("count", count);
+    if( reply->isFinished() )
+    {
+        reply->deleteLater();
+        return false;
+    }
+
     connect( reply, SIGNAL(finished()), this, SLOT(replyReceived()) );
     return true;
 }
@@ -198,10 +275,24 @@ bool Epsolar::readRegister( qint32 req )
 void Epsolar::replyReceived()
 {
     QModbusReply *reply = qobject_cast< QModbusReply * >( sender() );
+    quint32 tag = reply->property("tag").toUInt();
     if( reply->error() != QModbusDevice::NoError )
     {
         //qDebug() << "REPLY: " << reply->errorString();
+        if( reply->error() == QModbusDevice::TimeoutError )
+            m_timeouts++;
+
+        // Only these say the range itself is the problem, anything else may go away by itself:
+        QModbusResponse raw = reply->rawResult();
+        bool rejected = reply->error() == QModbusDevice::ProtocolError && raw.isException() &&
+                ( raw.exceptionCode() == QModbusPdu::IllegalFunction ||
+                  raw.exceptionCode() == QModbusPdu::IllegalDataAddress ||
+                  raw.exceptionCode() == QModbusPdu::IllegalDataValue );
+
+        quint16 start = reply->property("start").toUInt();
+        quint16 count = reply->property("count").toUInt();
         reply->deleteLater();
+        emit registerError( tag, start, count, rejected );
         return;
     }
 
@@ -213,12 +304,13 @@ void Epsolar::replyReceived()
         list.append( data.value(x) );
 
     reply->deleteLater();
-    qDebug() << list;
-    emit registerResult( data.startAddress(), list );
+    emit registerResult( tag, data.startAddress(), list );
 }
 
 QString Epsolar::errorString()
 {
-    return m_client.errorString();
+    if( !m_client )
+        return QString("Not open");
+    return m_client->errorString();
 }
 #endif
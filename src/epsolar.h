@@ -1,6 +1,7 @@
 #ifndef EPSOLAR_H
 #define EPSOLAR_H
 
+#include <QElapsedTimer>
 #include <QObject>
 #include <QVariant>
 
@@ -18,10 +19,18 @@ public:
     explicit Epsolar(QObject *parent = 0);
     ~Epsolar();
 
+    int                     m_timeout;
+    quint32                 m_timeouts;
+    QElapsedTimer           m_reconnectClock;   // Since the last attempt to reconnect.
+
 #ifdef LIBMB
     modbus_t               *m_ctx;
+    bool                    m_network;          // MODBUS TCP rather than RTU.
+
+    void applyTimeout();
+    void reconnect(int error);
 #else
-    QModbusRtuSerialMaster  m_client;
+    QModbusClient          *m_client;
 
     QString                 m_portName;
     QSerialPort::Parity     m_parity;
@@ -35,13 +44,22 @@ public:
 public:
     Epsolar();
 
+    // Requests are matched back up by 'tag'. With libmodbus the result (or
+    // error) is emitted before readRegisters() returns, which only returns
+    // false if the request couldn't be sent at all.
+    void setTimeout(int ms) { m_timeout = ms; }
+    quint32 timeouts() const { return m_timeouts; }
+
 signals:
-    void registerResult(quint16 reg, QVariantList values);
+    void registerResult(quint32 tag, quint16 reg, QVariantList values);
+    // 'rejected' if the device answered with an exception saying it won't
+    // read that range, rather than the request or reply getting lost:
+    void registerError(quint32 tag, quint16 reg, quint16 count, bool rejected);
 
 public slots:
     bool open(const QString &portName, quint32 baud, int data, const QString &parity, int stop );
     bool open(const QString &netAddr, int netPort );
-    bool readRegister(qint32 req);
+    bool readRegisters(quint32 tag, int slave, quint16 start, quint16 count);
 
     QString errorString();
 #ifndef LIBMB
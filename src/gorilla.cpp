@@ -0,0 +1,218 @@
+#include "gorilla.h"
+
+#include <cstring>
+
+static inline quint64 doubleBits(double value)
+{
+    quint64 bits;
+    memcpy( &bits, &value, sizeof(bits) );
+    return bits;
+}
+
+static inline double bitsDouble(quint64 bits)
+{
+    double value;
+    memcpy( &value, &bits, sizeof(value) );
+    return value;
+}
+
+// Small negative and positive numbers both end up with few significant bits:
+static inline quint64 zigzag(qint64 value)
+{
+    return ( (quint64)value << 1 ) ^ (quint64)( value >> 63 );
+}
+
+static inline qint64 unzigzag(quint64 value)
+{
+    return (qint64)( value >> 1 ) ^ -(qint64)( value & 1 );
+}
+
+void BitWriter::write(quint64 value, int bits)
+{
+    while( bits > 0 )
+    {
+        if( m_free == 0 )
+        {
+            m_data.append('\0');
+            m_free = 8;
+        }
+
+        int take = qMin( bits, m_free );
+        quint64 chunk = ( value >> ( bits - take ) ) & ( ( 1ULL << take ) - 1 );
+        m_data[ m_data.size() - 1 ] = m_data[ m_data.size() - 1 ] | (char)( chunk << ( m_free - take ) );
+        m_free -= take;
+        bits -= take;
+    }
+}
+
+bool BitReader::read(int bits, quint64 &value)
+{
+    if( m_pos + bits > m_bits )
+        return false;
+
+    value = 0;
+    while( bits > 0 )
+    {
+        int left = 8 - ( m_pos % 8 );
+        int take = qMin( bits, left );
+        quint64 chunk = ( m_data[ m_pos / 8 ] >> ( left - take ) ) & ( ( 1 << take ) - 1 );
+        value = ( value << take ) | chunk;
+        m_pos += take;
+        bits -= take;
+    }
+    return true;
+}
+
+void DeltaEncoder::encode(BitWriter &out, qint64 value)
+{
+    if( m_first )
+    {
+        out.write( (quint64)value, 64 );
+        m_prev = value;
+        m_first = false;
+        return;
+    }
+
+    qint64 delta = value - m_prev;
+    quint64 dod = zigzag( delta - m_prevDelta );
+    m_prev = value;
+    m_prevDelta = delta;
+
+    if( dod == 0 )
+        out.write(0, 1);
+    else if( dod < ( 1 << 7 ) )
+    {
+        out.write(2, 2);
+        out.write(dod, 7);
+    }
+    else if( dod < ( 1 << 9 ) )
+    {
+        out.write(6, 3);
+        out.write(dod, 9);
+    }
+    else if( dod < ( 1 << 12 ) )
+    {
+        out.write(14, 4);
+        out.write(dod, 12);
+    }
+    else
+    {
+        out.write(15, 4);
+        out.write(dod, 64);
+    }
+}
+
+bool DeltaDecoder::decode(BitReader &in, qint64 &value)
+{
+    quint64 bits;
+    if( m_first )
+    {
+        if( !in.read(64, bits) )
+            return false;
+        m_prev = (qint64)bits;
+        m_first = false;
+        value = m_prev;
+        return true;
+    }
+
+    // Count the leading ones of the prefix, at most four:
+    int ones = 0;
+    while( ones < 4 )
+    {
+        if( !in.read(1, bits) )
+            return false;
+        if( bits == 0 )
+            break;
+        ones++;
+    }
+
+    static const int widths[5] = { 0, 7, 9, 12, 64 };
+    quint64 dod = 0;
+    if( ones > 0 && !in.read(widths[ones], dod) )
+        return false;
+
+    m_prevDelta += unzigzag(dod);
+    m_prev += m_prevDelta;
+    value = m_prev;
+    return true;
+}
+
+void XorEncoder::encode(BitWriter &out, double value)
+{
+    quint64 bits = doubleBits(value);
+    if( m_first )
+    {
+        out.write(bits, 64);
+        m_prev = bits;
+        m_first = false;
+        return;
+    }
+
+    quint64 x = bits ^ m_prev;
+    m_prev = bits;
+    if( x == 0 )
+    {
+        out.write(0, 1);
+        return;
+    }
+
+    int leading = qMin( __builtin_clzll(x), 31 );
+    int trailing = __builtin_ctzll(x);
+
+    // Fits in the last window? Then only the window is stored:
+    if( m_leading >= 0 && leading >= m_leading && trailing >= m_trailing )
+    {
+        out.write(2, 2);
+        out.write( x >> m_trailing, 64 - m_leading - m_trailing );
+        return;
+    }
+
+    int significant = 64 - leading - trailing;
+    out.write(3, 2);
+    out.write(leading, 5);
+    out.write(significant - 1, 6);
+    out.write(x >> trailing, significant);
+    m_leading = leading;
+    m_trailing = trailing;
+}
+
+bool XorDecoder::decode(BitReader &in, double &value)
+{
+    quint64 bits;
+    if( m_first )
+    {
+        if( !in.read(64, bits) )
+            return false;
+        m_prev = bits;
+        m_first = false;
+        value = bitsDouble(m_prev);
+        return true;
+    }
+
+    if( !in.read(1, bits) )
+        return false;
+    if( bits == 0 )
+    {
+        value = bitsDouble(m_prev);
+        return true;
+    }
+
+    if( !in.read(1, bits) )
+        return false;
+    if( bits == 1 )
+    {
+        quint64 leading, significant;
+        if( !in.read(5, leading) || !in.read(6, significant) )
+            return false;
+        m_leading = (int)leading;
+        m_trailing = 64 - m_leading - ( (int)significant + 1 );
+    }
+
+    quint64 x;
+    if( !in.read(64 - m_leading - m_trailing, x) )
+        return false;
+
+    m_prev ^= x << m_trailing;
+    value = bitsDouble(m_prev);
+    return true;
+}
@@ -0,0 +1,81 @@
+#ifndef GORILLA_H
+#define GORILLA_H
+
+#include <QByteArray>
+
+// Bit-packed column encodings after Facebook's Gorilla: timestamps as
+// delta-of-deltas, floating point values XORed against the previous one.
+// Regular series compress to a couple of bits per value.
+
+class BitWriter
+{
+    QByteArray      m_data;
+    int             m_free;     // Unused bits left in the last byte.
+
+public:
+    BitWriter() : m_free(0) {}
+
+    void write(quint64 value, int bits);
+    const QByteArray &data() const { return m_data; }
+};
+
+class BitReader
+{
+    const uchar     *m_data;
+    qint64          m_bits;
+    qint64          m_pos;
+
+public:
+    BitReader(const uchar *data, int size) : m_data(data), m_bits( (qint64)size * 8 ), m_pos(0) {}
+
+    // False once the data runs out:
+    bool read(int bits, quint64 &value);
+};
+
+class DeltaEncoder
+{
+    qint64          m_prev;
+    qint64          m_prevDelta;
+    bool            m_first;
+
+public:
+    DeltaEncoder() : m_prev(0), m_prevDelta(0), m_first(true) {}
+    void encode(BitWriter &out, qint64 value);
+};
+
+class DeltaDecoder
+{
+    qint64          m_prev;
+    qint64          m_prevDelta;
+    bool            m_first;
+
+public:
+    DeltaDecoder() : m_prev(0), m_prevDelta(0), m_first(true) {}
+    bool decode(BitReader &in, qint64 &value);
+};
+
+class XorEncoder
+{
+    quint64         m_prev;
+    int             m_leading;  // Of the last stored window, -1 before there is one.
+    int             m_trailing;
+    bool            m_first;
+
+public:
+    XorEncoder() : m_prev(0), m_leading(-1), m_trailing(0), m_first(true) {}
+    void encode(BitWriter &out, double value);
+};
+
+class XorDecoder
+{
+    quint64         m_prev;
+    int             m_leading;
+    int             m_trailing;
+    bool            m_first;
+
+public:
+    XorDecoder() : m_prev(0), m_leading(0), m_trailing(0), m_first(true) {}
+    bool decode(BitReader &in, double &value);
+};
+
+#endif // GORILLA_H
@@ -0,0 +1,10 @@
+#include "historystore.h"
+#include "segmentstore.h"
+#include "sqlstore.h"
+
+HistoryStore *HistoryStore::create(QSettings *settings, const QString &name)
+{
+    if( settings->value("historyBackend", "sql").toString() == "native" )
+        return new SegmentStore(settings);
+    return new SqlStore(settings, name);
+}
@@ -0,0 +1,69 @@
+#ifndef HISTORYSTORE_H
+#define HISTORYSTORE_H
+
+#include <QList>
+#include <QSettings>
+#include <QString>
+
+// Resolutions of stored history, finest first:
+#define TIER_FIVE_MINUTES 0
+#define TIER_HOUR 1
+#define TIER_DAY 2
+#define TIER_MONTH 3
+#define TIER_COUNT 4
+
+struct HistoryRow
+{
+    quint16     device;
+    quint16     reg;
+    double      min;
+    double      max;
+    double      average;
+    qint64      tstart;     // Epoch ms.
+    qint64      tend;
+    int         samples;    // Five-minute rows it was made from, to weigh late ones merged into it.
+
+    HistoryRow() : samples(1) {}
+};
+
+// A range of one tier whose rows have changed:
+struct HistorySpan
+{
+    int         tier;       // -1 if nothing changed.
+    qint64      from;       // Epoch ms.
+    qint64      to;
+};
+
+// Where five-minute averages are kept, and compacted into hourly, daily and
+// monthly tiers. Each thread opens its own, reads from the Controller and
+// writes from the PersistWorker.
+class HistoryStore
+{
+public:
+    virtual ~HistoryStore() {}
+
+    // Picks the backend named by "historyBackend". 'name' tells apart the
+    // stores opened by different threads:
+    static HistoryStore *create(QSettings *settings, const QString &name);
+
+    virtual bool open() = 0;
+    virtual bool isOpen() const = 0;
+    virtual QString errorString() const = 0;
+
+    // Five-minute rows, in any order. One that's already there is ignored,
+    // one whose hour was already compacted is merged into it, weighted by
+    // samples. 'merged' is the range of any tier above it changed there and
+    // then (the SQL backend merges on its next compaction instead):
+    virtual bool write(const QList< HistoryRow > &rows, HistorySpan *merged) = 0;
+
+    // One bounded step of compaction, 'done' once nothing is left to do.
+    // 'compacted' is the range of the tier it wrote to:
+    virtual bool compact(bool *done, HistorySpan *compacted) = 0;
+
+    // Rows of one tier starting in [from, to) (five-minute and hourly rows
+    // must also end by 'to'), by register then time, at most 'limit' of them.
+    // All registers if 'regs' is empty:
+    virtual QList< HistoryRow > read(int tier, quint16 device, qint64 from, qint64 to, const QList< quint16 > &regs, quint32 limit) = 0;
+};
+
+#endif // HISTORYSTORE_H
@@ -0,0 +1,43 @@
+#include "lagmonitor.h"
+
+#include <QDebug>
+
+#define LAG_INTERVAL_MS 100
+
+LagMonitor::LagMonitor(const QString &name, int reportSeconds, QObject *parent) : QObject(parent),
+    m_reportSeconds(reportSeconds),
+    m_ticks(0),
+    m_totalLag(0),
+    m_maxLag(0)
+{
+    setObjectName(name);
+
+    m_timer.setInterval(LAG_INTERVAL_MS);
+    m_timer.setTimerType(Qt::PreciseTimer);
+    connect( &m_timer, &QTimer::timeout, this, &LagMonitor::tick );
+    m_timer.start();
+
+    m_clock.start();
+    m_reportClock.start();
+}
+
+void LagMonitor::tick()
+{
+    qint64 lag = m_clock.restart() - LAG_INTERVAL_MS;
+    if( lag < 0 )
+        lag = 0;
+
+    m_ticks++;
+    m_totalLag += lag;
+    if( lag > m_maxLag )
+        m_maxLag = lag;
+
+    if( m_reportSeconds > 0 && m_reportClock.elapsed() >= m_reportSeconds * 1000 )
+    {
+        qDebug() << "Event loop lag (" << objectName() << "): avg" << averageLag() << "ms, max" << m_maxLag << "ms";
+        m_reportClock.restart();
+        m_ticks = 0;
+        m_totalLag = 0;
+        m_maxLag = 0;
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef LAGMONITOR_H
+#define LAGMONITOR_H
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QTimer>
+
+// Measures how late the owning thread's event loop services a fixed-rate
+// timer. Anything blocking that loop (serial I/O, SQL, etc.) shows up as lag.
+class LagMonitor : public QObject
+{
+    Q_OBJECT
+
+    QTimer          m_timer;
+    QElapsedTimer   m_clock;
+    QElapsedTimer   m_reportClock;
+    int             m_reportSeconds;
+
+    qint64          m_ticks;
+    qint64          m_totalLag;
+    qint64          m_maxLag;
+
+public:
+    explicit LagMonitor(const QString &name, int reportSeconds=60, QObject *parent = 0);
+
+    qint64 maxLag() const { return m_maxLag; }
+    qint64 averageLag() const { return m_ticks > 0 ? m_totalLag / m_ticks : 0; }
+
+private slots:
+    void tick();
+};
+
+#endif // LAGMONITOR_H
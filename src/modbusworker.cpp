@@ -0,0 +1,383 @@
+#include "modbusworker.h"
+#include "epsolar.h"
+
+#include <QDebug>
+#include <QStringList>
+
+#include <algorithm>
+
+ModbusWorker::ModbusWorker(QSettings *settings, const BusConfig &bus, const QMap< quint16, int > &registers, QObject *parent) : QObject(parent),
+    m_epsolar(nullptr),
+    m_timer(nullptr),
+    m_deadlineTimer(nullptr),
+    m_next(0),
+    m_busy(false),
+    m_pumping(false),
+    m_nextTag(1),
+    m_bus(bus),
+    m_registers(registers.keys()),
+    m_notified(false),
+    m_dropped(0)
+{
+    m_pollFrequency = settings->value("epsolarPollFrequencyMS", 50).toInt();
+    m_deadline = settings->value("epsolarCycleDeadlineMS", 1000).toInt();
+    m_timeout = settings->value("epsolarTimeoutMS", 1000).toInt();
+    m_maxRetries = settings->value("epsolarRetries", 1).toInt();
+
+#ifdef LIBMB
+    // libmodbus blocks until each reply arrives, there's only ever one in flight.
+    m_window = 1;
+#else
+    // An RTU bus can only carry one request at a time, a TCP gateway may queue several:
+    m_window = qMax( 1, settings->value("epsolarInflight", 1).toInt() );
+#endif
+
+    // Read contiguous (or nearly so) registers in one request each, keeping
+    // registers with different poll intervals in separate blocks:
+    int gap = settings->value("epsolarBlockGap", 10).toInt();
+    int maxBlockSize = settings->value("epsolarMaxBlockSize", 32).toInt();
+
+    QMap< int, QList< quint16 > > groups;
+    foreach( quint16 reg, registers.keys() )
+        groups[ registers[reg] ].append(reg);
+
+    foreach( const BusDevice &dev, m_bus.devices )
+    {
+        foreach( int interval, groups.keys() )
+        {
+            QList< RegisterBlock > blocks = RegisterPlan::compile( groups[interval], gap, maxBlockSize );
+            for( int x=0; x < blocks.length(); x++ )
+            {
+                blocks[x].interval = interval;
+                blocks[x].device = dev.id;
+                blocks[x].slave = dev.slave;
+                m_blocks.append( blocks[x] );
+            }
+        }
+    }
+
+    foreach( const RegisterBlock &block, m_blocks )
+        qDebug() << "Register block: device" << block.device << ":" << block.start << "-" << ( block.start + block.count - 1 ) << "every" << block.interval << "ms";
+
+    m_uptime.start();
+}
+
+void ModbusWorker::start()
+{
+    // Runs on the worker thread, so the device and timer belong to it:
+    m_epsolar = new Epsolar(this);
+    m_epsolar->setTimeout(m_timeout);
+    connect( m_epsolar, &Epsolar::registerResult, this, &ModbusWorker::registerReceived );
+    connect( m_epsolar, &Epsolar::registerError, this, &ModbusWorker::registerFailed );
+
+    if( !m_bus.networkAddress.isEmpty() )
+    {
+        if( !m_epsolar->open(m_bus.networkAddress, m_bus.networkPort) )
+        {
+            qDebug() << "Failed to connect to " << m_bus.networkAddress << m_epsolar->errorString();
+            return;
+        }
+    }
+    else if( !m_epsolar->open(m_bus.devicePath, 115200, 8, "N", 1) )
+    {
+        qDebug() << "Failed to open " << m_bus.devicePath << m_epsolar->errorString();
+        return;
+    }
+
+    m_deadlineTimer = new QTimer(this);
+    m_deadlineTimer->setInterval(m_deadline);
+    m_deadlineTimer->setSingleShot(true);
+    connect( m_deadlineTimer, &QTimer::timeout, this, &ModbusWorker::deadlineExpired );
+
+    m_timer = new QTimer(this);
+    m_timer->setInterval(m_pollFrequency);
+    m_timer->setSingleShot(false);
+    connect( m_timer, &QTimer::timeout, this, &ModbusWorker::timerTriggered );
+    m_timer->start();
+}
+
+QList< BusConfig > ModbusWorker::loadBuses(QSettings *settings)
+{
+    QList< BusConfig > buses;
+    quint16 nextId = 1;
+
+    int size = settings->beginReadArray("buses");
+    for( int x=0; x < size; x++ )
+    {
+        settings->setArrayIndex(x);
+
+        BusConfig bus;
+        bus.devicePath = settings->value("devicePath", "").toString();
+        bus.networkAddress = settings->value("networkAddress", "").toString();
+        bus.networkPort = settings->value("networkPort", 502).toInt();
+
+        // Slave addresses, and optionally the device IDs to report them as:
+        QStringList slaves = settings->value("slaves", "1").toStringList();
+        QStringList ids = settings->value("ids").toStringList();
+        for( int y=0; y < slaves.length(); y++ )
+        {
+            BusDevice dev;
+            dev.slave = slaves[y].trimmed().toInt();
+            dev.id = y < ids.length() ? ids[y].trimmed().toInt() : nextId;
+            nextId = qMax( nextId, dev.id ) + 1;
+            bus.devices.append(dev);
+        }
+
+        if( !bus.devices.isEmpty() )
+            buses.append(bus);
+    }
+    settings->endArray();
+
+    if( buses.isEmpty() )
+    {
+        // Just the one controller, as slave 1:
+        BusConfig bus;
+        bus.devicePath = settings->value("epsolarDevicePath", "/dev/ttyXRUSB0").toString();
+        bus.networkAddress = settings->value("epsolarNetworkAddress", "").toString();
+        bus.networkPort = settings->value("epsolarNetworkPort", 502).toInt();
+
+        BusDevice dev;
+        dev.id = 1;
+        dev.slave = 1;
+        bus.devices.append(dev);
+        buses.append(bus);
+    }
+
+    return buses;
+}
+
+bool ModbusWorker::takeBatch(RegisterBatch &batch)
+{
+    return m_ring.pop(batch);
+}
+
+void ModbusWorker::rearm()
+{
+    // Clear before draining: anything pushed after this raises a new signal.
+    m_notified.store(false);
+}
+
+void ModbusWorker::publish(const RegisterBatch &batch)
+{
+    // Registers never take the room kept for the end of cycle markers, one
+    // per device, nor go ahead of ones still owed:
+    pushEnds();
+    bool room = m_pendingEnds.isEmpty() && (int)m_ring.size() + m_bus.devices.length() < BATCH_RING_SIZE - 1;
+    if( !room || !m_ring.push(batch) )
+    {
+        m_dropped++;
+        if( m_dropped % 100 == 1 )
+            qWarning() << "Register ring full, dropped batches: " << m_dropped;
+    }
+
+    notify();
+}
+
+void ModbusWorker::pushEnds()
+{
+    // The Controller only publishes a cycle once it sees its end, so these are never dropped:
+    while( !m_pendingEnds.isEmpty() )
+    {
+        RegisterBatch marker;
+        marker.device = m_pendingEnds.first();
+        marker.start = 0;
+        marker.count = 0;
+        marker.ok = true;
+        marker.cycleEnd = true;
+        marker.retries = 0;
+        if( !m_ring.push(marker) )
+            return;
+        m_pendingEnds.removeFirst();
+    }
+}
+
+void ModbusWorker::notify()
+{
+    if( !m_notified.exchange(true) )
+        emit batchesReady();
+}
+
+void ModbusWorker::timerTriggered()
+{
+    // Markers that found the ring full go in as soon as it's been drained:
+    if( !m_pendingEnds.isEmpty() )
+    {
+        pushEnds();
+        notify();
+    }
+
+    // Still working through the last cycle?
+    if( m_busy || m_blocks.isEmpty() )
+        return;
+
+    // Pick whatever is due, most overdue first. Slow registers only come
+    // up occasionally, leaving the bus to the fast ones in between:
+    qint64 now = m_uptime.elapsed();
+    m_cycle.clear();
+    for( int x=0; x < m_blocks.length(); x++ )
+    {
+        if( m_blocks[x].due <= now )
+            m_cycle.append(x);
+    }
+    if( m_cycle.isEmpty() )
+        return;
+
+    std::stable_sort( m_cycle.begin(), m_cycle.end(), [this]( int a, int b ) {
+        return m_blocks[a].due < m_blocks[b].due;
+    } );
+
+    m_busy = true;
+    m_next = 0;
+    m_cycleClock.start();
+    m_deadlineTimer->start();
+    pump();
+}
+
+void ModbusWorker::pump()
+{
+    // Replies can arrive (and call back in here) from inside send(), the outer loop carries on for them:
+    if( m_pumping || !m_busy )
+        return;
+
+    // Keep the window full, each request goes out as soon as there's room for it.
+    // The deadline timer can't fire while a blocking read holds this thread, so check the clock too:
+    m_pumping = true;
+    while( m_busy && m_inflight.size() < m_window && m_next < m_cycle.length() && m_cycleClock.elapsed() < m_deadline )
+        send( m_cycle[m_next++], 0 );
+    m_pumping = false;
+
+    if( m_busy && m_inflight.isEmpty() && ( m_next >= m_cycle.length() || m_cycleClock.elapsed() >= m_deadline ) )
+        endCycle();
+}
+
+void ModbusWorker::send(int block, int retries)
+{
+    quint32 tag = m_nextTag++;
+    Transaction trans;
+    trans.block = block;
+    trans.retries = retries;
+    m_inflight.insert(tag, trans);
+
+    const RegisterBlock &b = m_blocks[block];
+    if( !m_epsolar->readRegisters( tag, b.slave, b.start, b.count ) )
+        registerFailed( tag, b.start, b.count, false );
+}
+
+void ModbusWorker::deadlineExpired()
+{
+    if( !m_busy )
+        return;
+
+    endCycle();
+}
+
+void ModbusWorker::endCycle()
+{
+    m_deadlineTimer->stop();
+    int unread = ( m_cycle.length() - m_next ) + m_inflight.size();
+    if( unread > 0 )
+        qDebug() << "Poll cycle deadline passed with" << unread << "blocks unread," << m_epsolar->timeouts() << "timeouts so far";
+
+    // Anything still in flight is forgotten, its reply will be ignored:
+    m_inflight.clear();
+    m_busy = false;
+    m_next = 0;
+
+    // Whatever made it in so far gets published, for each device polled this cycle:
+    QList< quint16 > devices;
+    foreach( int block, m_cycle )
+    {
+        if( !devices.contains( m_blocks[block].device ) )
+            devices.append( m_blocks[block].device );
+    }
+
+    foreach( quint16 device, devices )
+    {
+        if( !m_pendingEnds.contains(device) )
+            m_pendingEnds.append(device);
+    }
+    pushEnds();
+    notify();
+}
+
+void ModbusWorker::registerReceived(quint32 tag, quint16 reg, QVariantList values)
+{
+    // Late replies belonging to a cycle that was already given up on aren't in flight anymore:
+    if( !m_inflight.contains(tag) )
+        return;
+
+    Transaction trans = m_inflight.take(tag);
+    RegisterBlock &block = m_blocks[trans.block];
+    block.due = m_uptime.elapsed() + block.interval;
+
+    RegisterBatch batch;
+    batch.device = block.device;
+    batch.start = block.start;
+    batch.count = qMin( qMin( values.length(), MAX_BLOCK_SIZE ), (int)block.count );
+    batch.ok = values.length() > 0;
+    batch.cycleEnd = false;
+    batch.retries = trans.retries;
+    for( int x=0; x < batch.count; x++ )
+        batch.values[x] = values[x].toUInt();
+    if( !batch.ok )
+    {
+        qDebug() << "Empty reply for register" << reg;
+        batch.count = block.count;
+    }
+    publish(batch);
+
+    pump();
+}
+
+void ModbusWorker::registerFailed(quint32 tag, quint16 reg, quint16 count, bool rejected)
+{
+    Q_UNUSED(reg)
+    Q_UNUSED(count)
+
+    if( !m_inflight.contains(tag) )
+        return;
+
+    // Copied, splitting it below changes m_blocks:
+    Transaction trans = m_inflight.take(tag);
+    RegisterBlock block = m_blocks[trans.block];
+
+    // Timeouts and garbled replies are retried, the block stays as it is:
+    if( !rejected && trans.retries < m_maxRetries )
+    {
+        if( m_cycleClock.elapsed() < m_deadline )
+        {
+            send( trans.block, trans.retries + 1 );
+            return pump();
+        }
+    }
+    else if( rejected && block.count > 1 )
+    {
+        // The device refused the whole range, fall back to reading its registers one at a time for good:
+        qDebug() << "Block read failed, splitting: " << block.start << "-" << ( block.start + block.count - 1 );
+        QList< RegisterBlock > singles = RegisterPlan::split( block, m_registers );
+        if( !singles.isEmpty() )
+        {
+            // Replace it in place so the other indexes stay valid, and send the singles next:
+            m_blocks[trans.block] = singles[0];
+            m_cycle.insert( m_next, trans.block );
+            for( int x=1; x < singles.length(); x++ )
+            {
+                m_blocks.append( singles[x] );
+                m_cycle.insert( m_next + x, m_blocks.length() - 1 );
+            }
+            return pump();
+        }
+    }
+
+    // Give up on it for this cycle and move along:
+    RegisterBatch batch;
+    batch.device = block.device;
+    batch.start = block.start;
+    batch.count = block.count;
+    batch.ok = false;
+    batch.cycleEnd = false;
+    batch.retries = trans.retries;
+    publish(batch);
+
+    pump();
+}
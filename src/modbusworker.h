@@ -0,0 +1,118 @@
+#ifndef MODBUSWORKER_H
+#define MODBUSWORKER_H
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMap>
+#include <QObject>
+#include <QSettings>
+#include <QTimer>
+#include <QVariantList>
+
+#include <atomic>
+
+#include "registerplan.h"
+#include "spscring.h"
+
+#define BATCH_RING_SIZE 64
+
+class Epsolar;
+
+struct BusDevice
+{
+    quint16     id;         // Tags its samples, averages and websocket messages.
+    int         slave;      // MODBUS slave address on the bus.
+};
+
+struct BusConfig
+{
+    QString     devicePath;
+    QString     networkAddress; // Polls a MODBUS TCP gateway instead of devicePath if set.
+    int         networkPort;
+    QList< BusDevice > devices;
+};
+
+struct RegisterBatch
+{
+    quint16     device;
+    quint16     start;
+    quint16     count;
+    bool        ok;         // False if the registers could not be read this cycle.
+    bool        cycleEnd;   // Marks the end of a poll cycle for 'device', carries no registers.
+    quint16     retries;
+    quint16     values[MAX_BLOCK_SIZE];
+};
+
+struct Transaction
+{
+    int         block;      // Index into m_blocks.
+    int         retries;
+};
+
+// Owns one MODBUS bus and polls every device on it from its own thread, so a
+// slow or missing reply never holds up the Controller's event loop (or the
+// other buses). Results are handed over through a lock-free ring.
+class ModbusWorker : public QObject
+{
+    Q_OBJECT
+
+    Epsolar         *m_epsolar;
+    QTimer          *m_timer;
+    QTimer          *m_deadlineTimer;
+    QElapsedTimer   m_cycleClock;
+    QElapsedTimer   m_uptime;
+    QList< int >    m_cycle;    // Indexes into m_blocks due this cycle, earliest deadline first.
+    int             m_next;     // Next entry of m_cycle to send.
+    bool            m_busy;
+    bool            m_pumping;
+
+    // Requests sent but not yet answered, by tag:
+    QHash< quint32, Transaction > m_inflight;
+    quint32         m_nextTag;
+    int             m_window;
+
+    BusConfig       m_bus;
+    int             m_pollFrequency;
+    int             m_deadline;
+    int             m_timeout;
+    int             m_maxRetries;
+    QList< quint16 > m_registers;
+    QList< RegisterBlock > m_blocks;
+
+    SpscRing< RegisterBatch, BATCH_RING_SIZE > m_ring;
+    std::atomic< bool > m_notified;
+    quint32         m_dropped;
+    QList< quint16 > m_pendingEnds; // Devices whose end of cycle marker didn't fit in the ring yet.
+
+    void pump();
+    void send(int block, int retries);
+    void endCycle();
+    void publish(const RegisterBatch &batch);
+    void pushEnds();
+    void notify();
+
+public:
+    // 'registers' maps each register to its poll interval in ms (0 for every cycle).
+    explicit ModbusWorker(QSettings *settings, const BusConfig &bus, const QMap< quint16, int > &registers, QObject *parent = 0);
+
+    // Reads the bus list from the settings, or a single bus from epsolarDevicePath.
+    static QList< BusConfig > loadBuses(QSettings *settings);
+
+    // Consumer side, called from the Controller's thread:
+    bool takeBatch(RegisterBatch &batch);
+    void rearm();
+
+signals:
+    void batchesReady();
+
+public slots:
+    void start();
+
+private slots:
+    void timerTriggered();
+    void deadlineExpired();
+    void registerReceived(quint32 tag, quint16 reg, QVariantList values);
+    void registerFailed(quint32 tag, quint16 reg, quint16 count, bool rejected);
+};
+
+#endif // MODBUSWORKER_H
@@ -0,0 +1,71 @@
+#include "outqueue.h"
+
+OutQueue::OutQueue() :
+    m_bytes(0)
+{
+}
+
+int OutQueue::push(const QByteArray &payload, quint8 opcode, int live, qint64 now)
+{
+    int superseded = 0;
+    if( live < -1 )
+    {
+        // A keyframe goes to the tail, and the frame it supersedes with it:
+        int device = -2 - live;
+        for( int x=0; x < m_frames.size(); x++ )
+        {
+            if( m_frames[x].live != device )
+                continue;
+
+            m_bytes -= m_frames[x].payload.size();
+            m_frames.removeAt(x);
+            superseded = 1;
+            break;
+        }
+    }
+    else if( live >= 0 )
+    {
+        for( int x=0; x < m_frames.size(); x++ )
+        {
+            OutFrame &frame = m_frames[x];
+            if( frame.live != live )
+                continue;
+
+            // Keeps its place, and how long it's been waiting:
+            m_bytes += payload.size() - frame.payload.size();
+            frame.payload = payload;
+            frame.opcode = opcode;
+            return 1;
+        }
+    }
+
+    OutFrame frame;
+    frame.payload = payload;
+    frame.opcode = opcode;
+    frame.live = live;
+    frame.queued = now;
+    m_frames.append(frame);
+    m_bytes += payload.size();
+    return superseded;
+}
+
+bool OutQueue::take(OutFrame &frame)
+{
+    if( m_frames.isEmpty() )
+        return false;
+
+    frame = m_frames.takeFirst();
+    m_bytes -= frame.payload.size();
+    return true;
+}
+
+void OutQueue::clear()
+{
+    m_frames.clear();
+    m_bytes = 0;
+}
+
+qint64 OutQueue::oldest() const
+{
+    return m_frames.isEmpty() ? 0 : m_frames.first().queued;
+}
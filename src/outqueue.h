@@ -0,0 +1,45 @@
+#ifndef OUTQUEUE_H
+#define OUTQUEUE_H
+
+#include <QByteArray>
+#include <QList>
+
+// The 'live' key of a device's keyframe. It's always delivered, and takes the
+// place of any live frame of that device still waiting, which it supersedes
+// and which must not go out after it:
+#define LIVE_KEYFRAME(device) ( -2 - (int)(device) )
+
+struct OutFrame
+{
+    QByteArray      payload;
+    quint8          opcode;     // To frame it with on the way out, 0 if it already is.
+    int             live;       // Device of a live reading, -1 or LIVE_KEYFRAME() for anything that must be delivered.
+    qint64          queued;     // Epoch ms it was first queued.
+};
+
+// Frames waiting for one websocket client to catch up. A live reading only
+// ever waits behind another one for the same device by replacing it, so a
+// slow client skips to the newest values instead of falling further behind.
+// Responses to its requests are always kept.
+class OutQueue
+{
+    QList< OutFrame > m_frames;
+    qint64          m_bytes;
+
+public:
+    OutQueue();
+
+    // Returns the number of frames superseded by this one, 0 or 1:
+    int push(const QByteArray &payload, quint8 opcode, int live, qint64 now);
+    bool take(OutFrame &frame);
+    void clear();
+
+    bool isEmpty() const { return m_frames.isEmpty(); }
+    int count() const { return m_frames.size(); }
+    qint64 bytes() const { return m_bytes; }
+
+    // When the frame at the head was queued, 0 if there's none:
+    qint64 oldest() const;
+};
+
+#endif // OUTQUEUE_H
@@ -0,0 +1,223 @@
+#include "persistworker.h"
+#include "spool.h"
+
+#include <QDebug>
+
+PersistWorker::PersistWorker(QSettings *settings, QObject *parent) : QObject(parent),
+    m_store(HistoryStore::create(settings, "persist")),
+    m_connected(false),
+    m_spool(new Spool),
+    m_replayOffset(0),
+    m_compressPending(true),
+    m_retryTimer(nullptr),
+    m_notified(false),
+    m_dropped(0),
+    m_maxDepth(0),
+    m_commits(0),
+    m_commitTime(0),
+    m_maxCommit(0)
+{
+    m_spoolPath = settings->value("spoolPath", "/var/lib/epsolar/averages.spool").toString();
+    m_spoolMaxBytes = settings->value("spoolMaxMB", 64).toLongLong() * 1024 * 1024;
+    m_retrySeconds = settings->value("databaseRetrySeconds", 30).toInt();
+    m_reportMS = settings->value("lagReportSeconds", 60).toInt() * 1000;
+}
+
+PersistWorker::~PersistWorker()
+{
+    delete m_store;
+    delete m_spool;
+}
+
+void PersistWorker::start()
+{
+    // Runs on the worker thread. The store only connects from here on, a
+    // connection may only be used by the thread that made it:
+    if( !m_spool->open(m_spoolPath, m_spoolMaxBytes) )
+        qWarning() << "Failed to open the spool, buckets are only kept in memory until written: " << m_spoolPath << m_spool->errorString();
+    else if( m_spool->size() > 0 )
+        qDebug() << "Spool holds" << ( m_spool->size() / SPOOL_RECORD_SIZE ) << "buckets from last time";
+
+    m_retryTimer = new QTimer(this);
+    m_retryTimer->setInterval( qMax( 1, m_retrySeconds ) * 1000 );
+    connect( m_retryTimer, &QTimer::timeout, this, &PersistWorker::replay );
+    m_retryTimer->start();
+
+    m_reportClock.start();
+    replay();
+}
+
+bool PersistWorker::connectStore()
+{
+    if( m_connected && m_store->isOpen() )
+        return true;
+
+    m_connected = m_store->open();
+    if( !m_connected )
+        qWarning() << "History store unreachable, spooling: " << m_store->errorString();
+    else
+        qDebug() << "History store (re)opened";
+
+    return m_connected;
+}
+
+void PersistWorker::submit(const PersistJob &job)
+{
+    if( !m_ring.push(job) )
+    {
+        m_dropped++;
+        if( m_dropped % 100 == 1 )
+            qWarning() << "Persistence queue full, dropped rows: " << m_dropped;
+    }
+
+    if( !m_notified.exchange(true) )
+        QMetaObject::invokeMethod( this, "flush", Qt::QueuedConnection );
+}
+
+void PersistWorker::flush()
+{
+    // Clear before draining: anything submitted after this queues a new flush.
+    m_notified.store(false);
+
+    unsigned int depth = m_ring.size();
+    if( depth > m_maxDepth )
+        m_maxDepth = depth;
+
+    // Everything goes to the spool before the database sees it:
+    PersistJob job;
+    bool appended = false;
+    while( m_ring.pop(job) )
+    {
+        if( job.type == JOB_COMPRESS )
+        {
+            m_compressPending = true;
+            continue;
+        }
+
+        if( m_spool->isOpen() )
+        {
+            if( m_spool->append(job.row) )
+                appended = true;
+            else
+                qWarning() << "Spool full or unwritable, bucket lost: " << job.row.device << job.row.reg;
+        }
+        else if( m_pending.length() < PERSIST_RING_SIZE )
+            m_pending.append(job.row);
+    }
+
+    if( appended && !m_spool->sync() )
+        qWarning() << "Failed to sync the spool: " << m_spool->errorString();
+
+    replay();
+    report();
+}
+
+void PersistWorker::replay()
+{
+    bool backlog = m_spool->size() > 0 || !m_pending.isEmpty() || m_compressPending;
+    if( !backlog || !connectStore() )
+        return;
+
+    // Large batches, each its own transaction. Records written twice (say the
+    // process died before the spool was cleared) are ignored by the store:
+    while( m_spool->isOpen() )
+    {
+        qint64 offset = m_replayOffset;
+        QList< HistoryRow > rows = m_spool->read(m_replayOffset, PERSIST_REPLAY_ROWS);
+        if( m_replayOffset == offset )
+        {
+            // All done, short of maybe a record torn by a crash:
+            if( m_spool->size() - m_replayOffset < SPOOL_RECORD_SIZE )
+            {
+                m_spool->clear();
+                m_replayOffset = 0;
+                break;
+            }
+
+            // Got nowhere, try again on the next timer rather than spin:
+            qWarning() << "Failed to read the spool at" << m_replayOffset << ": " << m_spool->errorString();
+            return;
+        }
+
+        if( !write(rows) )
+        {
+            m_replayOffset = offset;
+            return;
+        }
+    }
+
+    if( !m_pending.isEmpty() )
+    {
+        if( !write(m_pending) )
+            return;
+        m_pending.clear();
+    }
+
+    // Only once everything before it is in, a chunk at a time so new buckets aren't held up:
+    bool done = false;
+    HistorySpan compacted;
+    if( m_compressPending && m_store->compact(&done, &compacted) )
+    {
+        if( compacted.tier >= 0 )
+        {
+            emit stored( compacted.tier, compacted.from, compacted.to );
+
+            // The five-minute rows it was made from are gone too:
+            if( compacted.tier == TIER_HOUR )
+                emit stored( TIER_FIVE_MINUTES, 0, compacted.to );
+        }
+
+        if( done )
+            m_compressPending = false;
+        else
+            QTimer::singleShot( 0, this, &PersistWorker::replay );
+    }
+}
+
+bool PersistWorker::write(const QList< HistoryRow > &rows)
+{
+    if( rows.isEmpty() )
+        return true;
+
+    QElapsedTimer clock;
+    clock.start();
+
+    HistorySpan merged;
+    if( !m_store->write(rows, &merged) )
+    {
+        m_connected = false;
+        return false;
+    }
+
+    // Late rows (replayed from the spool) may land in ranges already served:
+    qint64 from = rows.first().tstart, to = rows.first().tend;
+    foreach( const HistoryRow &row, rows )
+    {
+        from = qMin( from, row.tstart );
+        to = qMax( to, row.tend );
+    }
+    emit stored( TIER_FIVE_MINUTES, from, to );
+    if( merged.tier >= 0 )
+        emit stored( merged.tier, merged.from, merged.to );
+
+    qint64 elapsed = clock.elapsed();
+    m_commits++;
+    m_commitTime += elapsed;
+    if( elapsed > m_maxCommit )
+        m_maxCommit = elapsed;
+
+    return true;
+}
+
+void PersistWorker::report()
+{
+    if( m_reportMS <= 0 || m_reportClock.elapsed() < m_reportMS || m_commits == 0 )
+        return;
+
+    qDebug() << "Persistence: max queue depth" << m_maxDepth << ", avg commit" << ( m_commitTime / m_commits ) << "ms, max" << m_maxCommit << "ms over" << m_commits << "commits";
+    m_maxDepth = 0;
+    m_commits = 0;
+    m_commitTime = 0;
+    m_maxCommit = 0;
+    m_reportClock.restart();
+}
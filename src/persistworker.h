@@ -0,0 +1,87 @@
+#ifndef PERSISTWORKER_H
+#define PERSISTWORKER_H
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QSettings>
+#include <QTimer>
+
+#include <atomic>
+
+#include "historystore.h"
+#include "spscring.h"
+
+#define PERSIST_RING_SIZE 4096
+
+// Largest number of rows replayed in one go:
+#define PERSIST_REPLAY_ROWS 1024
+
+// Kinds of PersistJob:
+#define JOB_AVERAGE 0
+#define JOB_COMPRESS 1
+
+struct PersistJob
+{
+    quint8      type;
+    HistoryRow  row;        // For JOB_AVERAGE.
+};
+
+class Spool;
+
+// Writes finished buckets to the history store from its own thread, over
+// its own connection, so a slow disk never holds up polling or the
+// websocket. Jobs are handed over through a lock-free ring, go to the spool
+// file first and are replayed from there in batches whenever the store is
+// reachable.
+class PersistWorker : public QObject
+{
+    Q_OBJECT
+
+    HistoryStore    *m_store;   // Made on the Controller's thread, QSettings is no use from this one.
+    bool            m_connected;
+
+    Spool           *m_spool;
+    QString         m_spoolPath;
+    qint64          m_spoolMaxBytes;
+    qint64          m_replayOffset; // Spool records before this are in the database.
+    QList< HistoryRow > m_pending;  // Only used if the spool can't be opened.
+    bool            m_compressPending; // Set at startup too, to catch up on missed hours.
+    QTimer          *m_retryTimer;
+    int             m_retrySeconds;
+
+    SpscRing< PersistJob, PERSIST_RING_SIZE > m_ring;
+    std::atomic< bool > m_notified;
+    quint32         m_dropped;
+
+    // Reported every m_reportMS:
+    QElapsedTimer   m_reportClock;
+    int             m_reportMS;
+    unsigned int    m_maxDepth;
+    quint32         m_commits;
+    qint64          m_commitTime;
+    qint64          m_maxCommit;
+
+    bool connectStore();
+    bool write(const QList< HistoryRow > &rows);
+    void report();
+
+public:
+    explicit PersistWorker(QSettings *settings, QObject *parent = 0);
+    ~PersistWorker();
+
+    // Producer side, called from the Controller's thread:
+    void submit(const PersistJob &job);
+
+signals:
+    // Rows of 'tier' in [from, to) were written or compacted:
+    void stored(int tier, qint64 from, qint64 to);
+
+public slots:
+    void start();
+
+private slots:
+    void flush();
+    void replay();
+};
+
+#endif // PERSISTWORKER_H
@@ -0,0 +1,42 @@
+#include "readingring.h"
+
+#include <QtNumeric>
+
+ReadingRing::ReadingRing() :
+    m_columns(0),
+    m_capacity(0),
+    m_head(0),
+    m_size(0)
+{
+}
+
+void ReadingRing::reset(int columns, int capacity)
+{
+    m_columns = qMax( 0, columns );
+    m_capacity = qMax( 1, capacity );
+    m_head = 0;
+    m_size = 0;
+
+    m_whence.fill( 0, m_capacity );
+    m_values.fill( qQNaN(), m_columns * m_capacity );
+}
+
+void ReadingRing::append(qint64 whence)
+{
+    m_whence[m_head] = whence;
+    for( int x=0; x < m_columns; x++ )
+        m_values[ x * m_capacity + m_head ] = qQNaN();
+
+    m_head = ( m_head + 1 ) % m_capacity;
+    if( m_size < m_capacity )
+        m_size++;
+}
+
+void ReadingRing::set(int column, float value)
+{
+    if( m_size == 0 || column < 0 || column >= m_columns )
+        return;
+
+    int newest = ( m_head + m_capacity - 1 ) % m_capacity;
+    m_values[ column * m_capacity + newest ] = value;
+}
@@ -0,0 +1,38 @@
+#ifndef READINGRING_H
+#define READINGRING_H
+
+#include <QVector>
+
+// Fixed-capacity history of published readings for one device, stored as
+// columns: one timestamp column shared by every value column. Appending
+// overwrites the oldest row once full. Values that weren't fresh in a row
+// are left NaN. Each row takes 8 bytes plus 4 per column.
+class ReadingRing
+{
+    QVector< qint64 >   m_whence;   // Epoch ms.
+    QVector< float >    m_values;   // Column after column, 'capacity' rows each.
+    int                 m_columns;
+    int                 m_capacity;
+    int                 m_head;     // Next row to write.
+    int                 m_size;
+
+    int position(int row) const { return ( m_head - m_size + row + m_capacity ) % m_capacity; }
+
+public:
+    ReadingRing();
+
+    void reset(int columns, int capacity);
+
+    // Starts a new row with every value NaN, then set() fills it in:
+    void append(qint64 whence);
+    void set(int column, float value);
+
+    int size() const { return m_size; }
+    int capacity() const { return m_capacity; }
+
+    // Rows are numbered from the oldest, 0, to the newest, size()-1:
+    qint64 whence(int row) const { return m_whence[ position(row) ]; }
+    float value(int column, int row) const { return m_values[ column * m_capacity + position(row) ]; }
+};
+
+#endif // READINGRING_H
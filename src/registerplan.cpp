@@ -0,0 +1,66 @@
+#include "registerplan.h"
+
+#include <algorithm>
+
+QList< RegisterBlock > RegisterPlan::compile(QList< quint16 > registers, int gap, int maxSize)
+{
+    QList< RegisterBlock > blocks;
+
+    if( gap < 0 )
+        gap = 0;
+    if( maxSize < 1 || maxSize > MAX_BLOCK_SIZE )
+        maxSize = MAX_BLOCK_SIZE;
+
+    std::sort( registers.begin(), registers.end() );
+
+    foreach( quint16 reg, registers )
+    {
+        if( !blocks.isEmpty() )
+        {
+            RegisterBlock &last = blocks.last();
+            int end = last.start + last.count - 1;
+            if( reg <= end )
+                continue; // Duplicate.
+
+            int unused = reg - end - 1;
+            int size = reg - last.start + 1;
+            if( unused <= gap && size <= maxSize )
+            {
+                last.count = size;
+                continue;
+            }
+        }
+
+        RegisterBlock block;
+        block.start = reg;
+        block.count = 1;
+        block.interval = 0;
+        block.due = 0;
+        block.device = 0;
+        block.slave = 1;
+        blocks.append(block);
+    }
+
+    return blocks;
+}
+
+QList< RegisterBlock > RegisterPlan::split(const RegisterBlock &block, const QList< quint16 > &registers)
+{
+    QList< RegisterBlock > singles;
+    for( int x=0; x < block.count; x++ )
+    {
+        quint16 reg = block.start + x;
+        if( !registers.contains(reg) )
+            continue;
+
+        RegisterBlock single;
+        single.start = reg;
+        single.count = 1;
+        single.interval = block.interval;
+        single.due = block.due;
+        single.device = block.device;
+        single.slave = block.slave;
+        singles.append(single);
+    }
+    return singles;
+}
@@ -0,0 +1,32 @@
+#ifndef REGISTERPLAN_H
+#define REGISTERPLAN_H
+
+#include <QList>
+
+// Largest number of input registers a single MODBUS read may return.
+#define MAX_BLOCK_SIZE 125
+
+struct RegisterBlock
+{
+    quint16     start;
+    quint16     count;
+    int         interval;   // Poll interval in ms, 0 for every cycle.
+    qint64      due;        // When it should next be read.
+    quint16     device;     // Device ID the block belongs to.
+    int         slave;      // MODBUS slave address of that device.
+};
+
+class RegisterPlan
+{
+public:
+    // Group a register list into contiguous ranges. Registers are merged into
+    // one block as long as no more than 'gap' unused registers sit between
+    // them and the block stays within 'maxSize' registers.
+    static QList< RegisterBlock > compile(QList< quint16 > registers, int gap, int maxSize);
+
+    // Break a block back down into single register reads, skipping the
+    // padding registers that were only read to bridge a gap.
+    static QList< RegisterBlock > split(const RegisterBlock &block, const QList< quint16 > &registers);
+};
+
+#endif // REGISTERPLAN_H
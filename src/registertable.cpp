@@ -0,0 +1,97 @@
+#include "registertable.h"
+
+#include <QHash>
+
+RegisterTable::RegisterTable() :
+    m_base(0)
+{
+}
+
+void RegisterTable::add(quint16 reg, const QString &name, const QString &measure, double scale, quint8 role, int poll)
+{
+    RegisterDescriptor desc;
+    desc.reg = reg;
+    desc.scale = scale;
+    desc.role = role;
+    desc.partner = -1;
+    desc.pair = -1;
+    desc.slot = -1;
+    desc.poll = poll;
+    desc.name = name;
+    desc.measure = measure;
+    m_descriptors.append(desc);
+}
+
+void RegisterTable::compile()
+{
+    m_pairs.clear();
+    m_slotNames.clear();
+    m_index.clear();
+    if( m_descriptors.isEmpty() )
+        return;
+
+    // Registers sharing a name are the two halves of one value, and share a slot:
+    QHash< QString, int > slotOf;
+    for( int x=0; x < m_descriptors.size(); x++ )
+    {
+        RegisterDescriptor &desc = m_descriptors[x];
+        if( !slotOf.contains(desc.name) )
+        {
+            slotOf[desc.name] = m_slotNames.size();
+            m_slotNames.append(desc.name);
+        }
+        desc.slot = slotOf[desc.name];
+    }
+
+    for( int x=0; x < m_descriptors.size(); x++ )
+    {
+        RegisterDescriptor &desc = m_descriptors[x];
+        for( int y=0; y < m_descriptors.size() && desc.role != SOLE; y++ )
+        {
+            const RegisterDescriptor &other = m_descriptors[y];
+            if( y != x && other.slot == desc.slot && other.role != SOLE && other.role != desc.role )
+                desc.partner = y;
+        }
+
+        // Both halves of a pair must be read together, go with the faster of the two:
+        if( desc.partner >= 0 && m_descriptors[desc.partner].poll < desc.poll )
+            desc.poll = m_descriptors[desc.partner].poll;
+    }
+
+    for( int x=0; x < m_descriptors.size(); x++ )
+    {
+        RegisterDescriptor &desc = m_descriptors[x];
+        if( desc.role != LOW || desc.partner < 0 )
+            continue;
+
+        RegisterPair pair;
+        pair.low = x;
+        pair.high = desc.partner;
+        pair.slot = desc.slot;
+        pair.scale = desc.scale;
+
+        desc.pair = m_pairs.size();
+        m_descriptors[desc.partner].pair = m_pairs.size();
+        m_pairs.append(pair);
+    }
+
+    quint16 lowest = m_descriptors[0].reg, highest = m_descriptors[0].reg;
+    foreach( const RegisterDescriptor &desc, m_descriptors )
+    {
+        if( desc.reg < lowest ) lowest = desc.reg;
+        if( desc.reg > highest ) highest = desc.reg;
+    }
+
+    m_base = lowest;
+    m_index.fill( -1, highest - lowest + 1 );
+    for( int x=0; x < m_descriptors.size(); x++ )
+        m_index[ m_descriptors[x].reg - m_base ] = x;
+}
+
+QList< quint16 > RegisterTable::registers() const
+{
+    QList< quint16 > regs;
+    foreach( const RegisterDescriptor &desc, m_descriptors )
+        regs.append(desc.reg);
+    return regs;
+}
@@ -0,0 +1,68 @@
+#ifndef REGISTERTABLE_H
+#define REGISTERTABLE_H
+
+#include <QList>
+#include <QString>
+#include <QVector>
+
+// Word roles:
+#define SOLE 0
+#define LOW 1
+#define HIGH 2
+
+struct RegisterDescriptor
+{
+    quint16     reg;
+    double      scale;      // 0 if the raw value is used as-is.
+    quint8      role;       // SOLE, LOW or HIGH.
+    int         partner;    // Index of the other half of a LOW/HIGH pair, -1 if none.
+    int         pair;       // Index into the pair table, -1 if none.
+    int         slot;       // Index into a device's value array, shared by both halves of a pair.
+    int         poll;       // Poll interval in ms, 0 for every cycle.
+    QString     name;
+    QString     measure;
+};
+
+// Both halves of a >16-bit value, resolved once so the value can be put
+// together as soon as its second word arrives.
+struct RegisterPair
+{
+    int         low;        // Descriptor indexes.
+    int         high;
+    int         slot;
+    double      scale;      // 0 if the combined value is used as-is.
+};
+
+// Flat, index-addressed register descriptions compiled once at startup so
+// the per-cycle path never has to look anything up by name.
+class RegisterTable
+{
+    QVector< RegisterDescriptor > m_descriptors;
+    QVector< RegisterPair > m_pairs;
+    QVector< QString >  m_slotNames;
+    QVector< int >      m_index;    // Register number - m_base -> descriptor index, -1 if unknown.
+    quint16             m_base;
+
+public:
+    RegisterTable();
+
+    void add(quint16 reg, const QString &name, const QString &measure, double scale, quint8 role, int poll);
+    void compile();
+
+    int count() const { return m_descriptors.size(); }
+    int slotCount() const { return m_slotNames.size(); }
+    const RegisterDescriptor &at(int index) const { return m_descriptors[index]; }
+    const RegisterPair &pair(int pair) const { return m_pairs[pair]; }
+    const QString &slotName(int slot) const { return m_slotNames[slot]; }
+    QList< quint16 > registers() const;
+
+    int indexOf(quint16 reg) const
+    {
+        int offset = (int)reg - m_base;
+        if( offset < 0 || offset >= m_index.size() )
+            return -1;
+        return m_index[offset];
+    }
+};
+
+#endif // REGISTERTABLE_H
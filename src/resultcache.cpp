@@ -0,0 +1,97 @@
+#include "resultcache.h"
+
+ResultCache::ResultCache(qint64 maxBytes) :
+    m_maxBytes(maxBytes),
+    m_bytes(0),
+    m_tick(0),
+    m_hits(0),
+    m_misses(0)
+{
+}
+
+void ResultCache::setMaxBytes(qint64 maxBytes)
+{
+    m_maxBytes = maxBytes;
+    evict();
+}
+
+bool ResultCache::lookup(const QString &key, QByteArray &payload)
+{
+    QHash< QString, CachedResult >::iterator it = m_entries.find(key);
+    if( it == m_entries.end() )
+    {
+        m_misses++;
+        return false;
+    }
+
+    it.value().used = ++m_tick;
+    payload = it.value().payload;
+    m_hits++;
+    return true;
+}
+
+void ResultCache::insert(const QString &key, const QByteArray &payload, const QVector< HistorySpan > &spans)
+{
+    // Not worth pushing everything else out for:
+    if( m_maxBytes <= 0 || payload.size() > m_maxBytes / 4 )
+        return;
+
+    if( m_entries.contains(key) )
+        m_bytes -= m_entries[key].payload.size();
+
+    CachedResult &entry = m_entries[key];
+    entry.payload = payload;
+    entry.spans = spans;
+    entry.used = ++m_tick;
+    m_bytes += payload.size();
+
+    evict();
+}
+
+void ResultCache::evict()
+{
+    // Few enough entries that a scan for the oldest is cheaper than keeping a list:
+    while( m_bytes > m_maxBytes && !m_entries.isEmpty() )
+    {
+        QHash< QString, CachedResult >::iterator oldest = m_entries.begin();
+        for( QHash< QString, CachedResult >::iterator it = m_entries.begin(); it != m_entries.end(); ++it )
+        {
+            if( it.value().used < oldest.value().used )
+                oldest = it;
+        }
+
+        m_bytes -= oldest.value().payload.size();
+        m_entries.erase(oldest);
+    }
+}
+
+void ResultCache::invalidate(int tier, qint64 from, qint64 to)
+{
+    QHash< QString, CachedResult >::iterator it = m_entries.begin();
+    while( it != m_entries.end() )
+    {
+        bool stale = false;
+        foreach( const HistorySpan &span, it.value().spans )
+        {
+            if( span.tier == tier && span.from < to && span.to > from )
+            {
+                stale = true;
+                break;
+            }
+        }
+
+        if( stale )
+        {
+            m_bytes -= it.value().payload.size();
+            it = m_entries.erase(it);
+        }
+        else
+            ++it;
+    }
+}
+
+void ResultCache::clear()
+{
+    m_entries.clear();
+    m_bytes = 0;
+}
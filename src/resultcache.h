@@ -0,0 +1,50 @@
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+#include <QVector>
+
+#include "historystore.h"
+
+struct CachedResult
+{
+    QByteArray      payload;    // The frame as sent, compressed or not.
+    QVector< HistorySpan > spans;   // What it was read from.
+    quint64         used;       // Tick of the last hit, for eviction.
+};
+
+// Finished history responses, by everything that went into them. Dropped as
+// soon as a bucket in any of their ranges is written or compacted, and the
+// least recently used first once over the size budget.
+class ResultCache
+{
+    QHash< QString, CachedResult > m_entries;
+    qint64          m_maxBytes;
+    qint64          m_bytes;
+    quint64         m_tick;
+    quint32         m_hits;
+    quint32         m_misses;
+
+    void evict();
+
+public:
+    explicit ResultCache(qint64 maxBytes = 0);
+
+    void setMaxBytes(qint64 maxBytes);
+
+    bool lookup(const QString &key, QByteArray &payload);
+    void insert(const QString &key, const QByteArray &payload, const QVector< HistorySpan > &spans);
+
+    // Drops whatever read rows of 'tier' in [from, to):
+    void invalidate(int tier, qint64 from, qint64 to);
+    void clear();
+
+    int count() const { return m_entries.size(); }
+    qint64 bytes() const { return m_bytes; }
+    quint32 hits() const { return m_hits; }
+    quint32 misses() const { return m_misses; }
+};
+
+#endif // RESULTCACHE_H
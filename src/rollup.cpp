@@ -0,0 +1,154 @@
+#include "rollup.h"
+
+static const qint64 rollupWidths[ROLLUP_LEVELS] = { 10000, 60000, 300000, 3600000, 86400000 };
+
+RollupSeries::RollupSeries() :
+    m_head(0),
+    m_size(0)
+{
+}
+
+void RollupSeries::reset(int capacity)
+{
+    m_buckets.resize( qMax( 1, capacity ) );
+    m_head = 0;
+    m_size = 0;
+}
+
+bool RollupSeries::fold(qint64 start, quint32 count, double min, double max, double sum, bool *opened)
+{
+    if( opened )
+        *opened = false;
+
+    if( m_size > 0 )
+    {
+        RollupBucket &newest = m_buckets[ ( m_head + m_buckets.size() - 1 ) % m_buckets.size() ];
+        if( start < newest.start )
+            return false;
+
+        if( start == newest.start )
+        {
+            if( min < newest.min ) newest.min = min;
+            if( max > newest.max ) newest.max = max;
+            newest.count += count;
+            newest.sum += sum;
+            return true;
+        }
+    }
+
+    RollupBucket &bucket = m_buckets[m_head];
+    bucket.start = start;
+    bucket.count = count;
+    bucket.min = min;
+    bucket.max = max;
+    bucket.sum = sum;
+
+    m_head = ( m_head + 1 ) % m_buckets.size();
+    if( m_size < m_buckets.size() )
+        m_size++;
+
+    if( opened )
+        *opened = true;
+    return true;
+}
+
+int RollupSeries::lowerBound(qint64 start) const
+{
+    int low = 0, high = m_size;
+    while( low < high )
+    {
+        int mid = ( low + high ) / 2;
+        if( at(mid).start < start )
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+Rollup::Rollup() :
+    m_registers(0),
+    m_offset(0)
+{
+    for( int x=0; x < ROLLUP_LEVELS; x++ )
+        m_complete[x] = 0;
+}
+
+qint64 Rollup::width(int level)
+{
+    return rollupWidths[level];
+}
+
+qint64 Rollup::align(int level, qint64 whence) const
+{
+    qint64 local = whence + m_offset;
+    return local - ( local % rollupWidths[level] ) - m_offset;
+}
+
+void Rollup::reset(int registers, const QVector< int > &capacity, qint64 now)
+{
+    m_registers = registers;
+    m_series.resize( ROLLUP_LEVELS * registers );
+    for( int level=0; level < ROLLUP_LEVELS; level++ )
+    {
+        for( int x=0; x < registers; x++ )
+            m_series[ level * registers + x ].reset( capacity.value(level, 1) );
+
+        // Only what's polled from now on, until seeded:
+        m_complete[level] = now;
+    }
+}
+
+void Rollup::fold(int level, int index, qint64 whence, quint32 count, double min, double max, double sum)
+{
+    RollupSeries &series = m_series[ level * m_registers + index ];
+
+    bool opened = false;
+    if( !series.fold( align(level, whence), count, min, max, sum, &opened ) )
+        return;
+
+    // The bucket before the one just opened is final, pass it up a level:
+    if( opened && series.size() > 1 && ( level == ROLLUP_FIVE_MINUTES || level == ROLLUP_HOUR ) )
+    {
+        const RollupBucket &closed = series.at( series.size() - 2 );
+        fold( level + 1, index, closed.start, 1, closed.min, closed.max, closed.mean() );
+    }
+}
+
+void Rollup::add(int index, qint64 whence, double value)
+{
+    if( index < 0 || index >= m_registers )
+        return;
+
+    fold( ROLLUP_TEN_SECONDS, index, whence, 1, value, value, value );
+    fold( ROLLUP_MINUTE, index, whence, 1, value, value, value );
+    fold( ROLLUP_FIVE_MINUTES, index, whence, 1, value, value, value );
+}
+
+void Rollup::seed(int level, int index, qint64 whence, double min, double max, double avg)
+{
+    if( index < 0 || index >= m_registers || level < 0 || level >= ROLLUP_LEVELS )
+        return;
+
+    fold( level, index, whence, 1, min, max, avg );
+}
+
+void Rollup::seeded(int level, qint64 since)
+{
+    if( since < m_complete[level] )
+        m_complete[level] = since;
+}
+
+bool Rollup::covers(int level, qint64 from) const
+{
+    // Whatever has rolled off the oldest end is gone:
+    qint64 complete = m_complete[level];
+    for( int x=0; x < m_registers; x++ )
+    {
+        const RollupSeries &series = m_series[ level * m_registers + x ];
+        if( series.size() == series.capacity() && series.at(0).start > complete )
+            complete = series.at(0).start;
+    }
+
+    return from >= complete;
+}
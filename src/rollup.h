@@ -0,0 +1,86 @@
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include <QVector>
+
+// Resolutions kept in memory, finest first:
+#define ROLLUP_TEN_SECONDS  0
+#define ROLLUP_MINUTE       1
+#define ROLLUP_FIVE_MINUTES 2
+#define ROLLUP_HOUR         3
+#define ROLLUP_DAY          4
+#define ROLLUP_LEVELS       5
+
+struct RollupBucket
+{
+    qint64      start;      // Epoch ms, aligned to the local wall clock.
+    quint32     count;      // Samples, or closed buckets of the level below.
+    float       min;
+    float       max;
+    double      sum;
+
+    double mean() const { return count > 0 ? sum / count : 0; }
+};
+
+// Fixed-capacity run of buckets of one register at one resolution, oldest
+// first. Once full, opening a bucket drops the oldest.
+class RollupSeries
+{
+    QVector< RollupBucket > m_buckets;
+    int                 m_head;     // Next bucket to open.
+    int                 m_size;
+
+public:
+    RollupSeries();
+
+    void reset(int capacity);
+
+    // Adds to the newest bucket if it starts at 'start', opens a new one if
+    // 'start' is later. Returns false if it was earlier and dropped.
+    bool fold(qint64 start, quint32 count, double min, double max, double sum, bool *opened = 0);
+
+    int size() const { return m_size; }
+    int capacity() const { return m_buckets.size(); }
+    const RollupBucket &at(int row) const { return m_buckets[ ( m_head - m_size + row + m_buckets.size() ) % m_buckets.size() ]; }
+
+    // First row starting at or after 'start', size() if none:
+    int lowerBound(qint64 start) const;
+};
+
+// Wall-clock-aligned min/max/avg pyramid of every register of one device.
+// Samples feed the 10 second, 1 minute and 5 minute levels directly; each
+// closed 5 minute bucket then counts once towards its hour, and each closed
+// hour once towards its day, the same way the hourly table is compressed.
+class Rollup
+{
+    QVector< RollupSeries > m_series;   // Level after level, one per register.
+    int                 m_registers;
+    qint64              m_offset;       // Local time's offset from UTC, ms.
+    qint64              m_complete[ROLLUP_LEVELS];  // Nothing is missing from here on.
+
+    void fold(int level, int index, qint64 whence, quint32 count, double min, double max, double sum);
+
+public:
+    Rollup();
+
+    static qint64 width(int level);
+    qint64 align(int level, qint64 whence) const;
+
+    // 'capacity' holds the number of buckets to keep at each level:
+    void reset(int registers, const QVector< int > &capacity, qint64 now);
+    void setUtcOffset(qint64 ms) { m_offset = ms; }
+
+    void add(int index, qint64 whence, double value);
+
+    // Loads an already-closed bucket from the database, oldest first. Once
+    // done, 'since' marks how far back the level is now complete:
+    void seed(int level, int index, qint64 whence, double min, double max, double avg);
+    void seeded(int level, qint64 since);
+
+    // True if every bucket from 'from' on is held in memory:
+    bool covers(int level, qint64 from) const;
+
+    const RollupSeries &series(int level, int index) const { return m_series[ level * m_registers + index ]; }
+};
+
+#endif // ROLLUP_H
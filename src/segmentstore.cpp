@@ -0,0 +1,815 @@
+#include "segmentstore.h"
+#include "gorilla.h"
+
+#include <QDataStream>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QStringList>
+#include <QtEndian>
+
+#include <algorithm>
+#include <limits>
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SEGMENT_MAGIC 0x45504232        // "EPB2"
+#define SEGMENT_HEADER_SIZE 28
+#define SEGMENT_COLUMNS 6
+#define SEGMENT_TAIL_RECORD 44
+
+static QByteArray tailRecord(const HistoryRow &row)
+{
+    QByteArray record;
+    QDataStream ds(&record, QIODevice::WriteOnly);
+    ds.setByteOrder(QDataStream::LittleEndian);
+    ds << row.tstart << row.tend << row.min << row.max << row.average << (qint32)row.samples;
+    return record;
+}
+
+// Settles two rows starting at the same time into 'kept', false if it stays as it was:
+static bool resolve(HistoryRow &kept, const HistoryRow &row, int conflict)
+{
+    if( conflict == SEGMENT_KEEP )
+        return false;
+    if( conflict == SEGMENT_REPLACE )
+    {
+        kept = row;
+        return true;
+    }
+
+    int samples = kept.samples + row.samples;
+    kept.average = ( kept.average * kept.samples + row.average * row.samples ) / samples;
+    kept.samples = samples;
+    kept.min = qMin( kept.min, row.min );
+    kept.max = qMax( kept.max, row.max );
+    kept.tend = qMax( kept.tend, row.tend );
+    return true;
+}
+
+// Puts 'row' in its place in 'rows', which are in order of their start:
+static bool place(QList< HistoryRow > &rows, const HistoryRow &row, int conflict)
+{
+    int x = 0;
+    while( x < rows.length() && rows[x].tstart < row.tstart )
+        x++;
+    if( x < rows.length() && rows[x].tstart == row.tstart )
+        return resolve( rows[x], row, conflict );
+
+    rows.insert(x, row);
+    return true;
+}
+
+SegmentSeries::SegmentSeries(const QString &base, quint16 device, quint16 reg) :
+    m_base(base),
+    m_inode(0),
+    m_map(nullptr),
+    m_mapped(0),
+    m_indexed(0),
+    m_damaged(false),
+    m_dirty(false),
+    device(device),
+    reg(reg)
+{
+}
+
+SegmentSeries::~SegmentSeries()
+{
+    close();
+}
+
+void SegmentSeries::close()
+{
+    if( m_map )
+        m_segment.unmap(m_map);
+    m_map = nullptr;
+    m_segment.close();
+    m_blocks.clear();
+    m_mapped = 0;
+    m_indexed = 0;
+    m_damaged = false;
+}
+
+bool SegmentSeries::refresh()
+{
+    QString path = m_base + ".seg";
+    struct stat st;
+    if( ::stat( QFile::encodeName(path).constData(), &st ) != 0 )
+    {
+        close();
+        return false;
+    }
+
+    // The writer never changes the file in place, it renames a new one over
+    // it (see publish()). What's mapped stays valid, but is out of date:
+    if( m_segment.isOpen() && (quint64)st.st_ino != m_inode )
+        close();
+
+    if( !m_segment.isOpen() )
+    {
+        m_segment.setFileName(path);
+        if( !m_segment.open(QIODevice::ReadOnly) )
+            return false;
+
+        struct stat own;
+        if( ::fstat( m_segment.handle(), &own ) != 0 )
+            return false;
+        m_inode = own.st_ino;
+    }
+
+    qint64 size = m_segment.size();
+    if( size <= m_mapped )
+        return true;
+
+    if( m_map )
+        m_segment.unmap(m_map);
+    m_map = m_segment.map(0, size);
+    m_mapped = m_map ? size : 0;
+    if( !m_map )
+        return false;
+
+    // Index whatever blocks were sealed since last time. One still being
+    // written stops the scan, it's picked up on a later call:
+    while( m_indexed + SEGMENT_HEADER_SIZE <= size )
+    {
+        const uchar *p = m_map + m_indexed;
+        if( qFromLittleEndian< quint32 >(p) != SEGMENT_MAGIC )
+        {
+            if( !m_damaged )
+                qWarning() << "Damaged segment, ignoring the rest of it: " << path << "at" << m_indexed;
+            m_damaged = true;
+            break;
+        }
+
+        SegmentBlock block;
+        block.offset = m_indexed;
+        block.count = qFromLittleEndian< quint16 >(p + 4);
+        block.firstStart = qFromLittleEndian< qint64 >(p + 8);
+        block.lastStart = qFromLittleEndian< qint64 >(p + 16);
+        block.bytes = qFromLittleEndian< quint32 >(p + 24);
+        if( m_indexed + SEGMENT_HEADER_SIZE + block.bytes > size )
+            break;
+
+        m_blocks.append(block);
+        m_indexed += SEGMENT_HEADER_SIZE + block.bytes;
+    }
+
+    return true;
+}
+
+QList< HistoryRow > SegmentSeries::decode(const SegmentBlock &block, quint16 device, quint16 reg) const
+{
+    QList< HistoryRow > rows;
+    const uchar *header = m_map + block.offset;
+    const uchar *payload = header + SEGMENT_HEADER_SIZE;
+    if( qChecksum( (const char*)payload, block.bytes ) != qFromLittleEndian< quint16 >(header + 6) )
+    {
+        qWarning() << "Skipping corrupt block in" << m_base << "at" << block.offset;
+        return rows;
+    }
+
+    // Each column is a length and its bit stream:
+    const uchar *columns[SEGMENT_COLUMNS];
+    int sizes[SEGMENT_COLUMNS];
+    int pos = 0;
+    for( int x=0; x < SEGMENT_COLUMNS; x++ )
+    {
+        if( pos + 4 > block.bytes )
+            return rows;
+        sizes[x] = qFromLittleEndian< quint32 >(payload + pos);
+        columns[x] = payload + pos + 4;
+        pos += 4 + sizes[x];
+        if( pos > block.bytes )
+            return rows;
+    }
+
+    BitReader starts( columns[0], sizes[0] );
+    BitReader lengths( columns[1], sizes[1] );
+    BitReader mins( columns[2], sizes[2] );
+    BitReader maxs( columns[3], sizes[3] );
+    BitReader averages( columns[4], sizes[4] );
+    BitReader samples( columns[5], sizes[5] );
+    DeltaDecoder startDecoder, lengthDecoder, samplesDecoder;
+    XorDecoder minDecoder, maxDecoder, averageDecoder;
+
+    for( int x=0; x < block.count; x++ )
+    {
+        HistoryRow row;
+        qint64 length, count;
+        row.device = device;
+        row.reg = reg;
+        if( !startDecoder.decode(starts, row.tstart) || !lengthDecoder.decode(lengths, length) ||
+            !minDecoder.decode(mins, row.min) || !maxDecoder.decode(maxs, row.max) || !averageDecoder.decode(averages, row.average) ||
+            !samplesDecoder.decode(samples, count) )
+            break;
+        row.tend = row.tstart + length;
+        row.samples = count;
+        rows.append(row);
+    }
+
+    return rows;
+}
+
+QList< HistoryRow > SegmentSeries::readTail()
+{
+    QList< HistoryRow > rows;
+    QFile file( m_base + ".tail" );
+    if( !file.open(QIODevice::ReadOnly) )
+        return rows;
+
+    // Only whole records, the writer may be part way through one:
+    QByteArray data = file.readAll();
+    QDataStream ds(data);
+    ds.setByteOrder(QDataStream::LittleEndian);
+    for( int x=0; x < data.size() / SEGMENT_TAIL_RECORD; x++ )
+    {
+        HistoryRow row;
+        row.device = device;
+        row.reg = reg;
+        qint32 samples;
+        ds >> row.tstart >> row.tend >> row.min >> row.max >> row.average >> samples;
+        row.samples = samples;
+        rows.append(row);
+    }
+    return rows;
+}
+
+QList< HistoryRow > SegmentSeries::rows(qint64 from, qint64 to)
+{
+    // The tail before the blocks: rows sealed in between then turn up twice
+    // (and are skipped) rather than not at all:
+    QList< HistoryRow > tail = readTail();
+    refresh();
+
+    QList< HistoryRow > rows;
+    foreach( const SegmentBlock &block, m_blocks )
+    {
+        if( block.lastStart < from || block.firstStart >= to )
+            continue;
+
+        foreach( const HistoryRow &row, decode(block, device, reg) )
+        {
+            if( row.tstart >= from && row.tstart < to )
+                rows.append(row);
+        }
+    }
+
+    qint64 sealed = m_blocks.isEmpty() ? std::numeric_limits< qint64 >::min() : m_blocks.last().lastStart;
+    foreach( const HistoryRow &row, tail )
+    {
+        if( row.tstart > sealed && row.tstart >= from && row.tstart < to )
+            rows.append(row);
+    }
+
+    return rows;
+}
+
+qint64 SegmentSeries::firstStart()
+{
+    refresh();
+    if( !m_blocks.isEmpty() )
+        return m_blocks.first().firstStart;
+
+    QList< HistoryRow > tail = readTail();
+    return tail.isEmpty() ? -1 : tail.first().tstart;
+}
+
+bool SegmentSeries::load()
+{
+    m_tailFile.setFileName( m_base + ".tail" );
+    if( !m_tailFile.open(QIODevice::ReadWrite) )
+        return false;
+
+    refresh();
+    qint64 sealed = m_blocks.isEmpty() ? std::numeric_limits< qint64 >::min() : m_blocks.last().lastStart;
+
+    // A crash between sealing a block and emptying the tail leaves rows in both:
+    QList< HistoryRow > rows = readTail();
+    m_tail.clear();
+    foreach( const HistoryRow &row, rows )
+    {
+        if( row.tstart > sealed )
+            m_tail.append(row);
+    }
+
+    if( m_tail.length() != rows.length() || m_tailFile.size() % SEGMENT_TAIL_RECORD != 0 )
+        return writeTail(m_tail) && sync();
+
+    return true;
+}
+
+bool SegmentSeries::writeTail(const QList< HistoryRow > &rows)
+{
+    // Into a new file renamed over the old one, so a crash part way through
+    // leaves one or the other whole:
+    QString path = m_base + ".tail";
+    QFile out( path + ".new" );
+    if( !out.open(QIODevice::WriteOnly | QIODevice::Truncate) )
+        return false;
+
+    bool success = true;
+    foreach( const HistoryRow &row, rows )
+        success = success && out.write( tailRecord(row) ) == SEGMENT_TAIL_RECORD;
+    if( !success || !out.flush() || ::fsync( out.handle() ) != 0 )
+    {
+        out.remove();
+        return false;
+    }
+    out.close();
+
+    m_tailFile.close();
+    success = ::rename( QFile::encodeName(out.fileName()).constData(), QFile::encodeName(path).constData() ) == 0;
+    if( !success )
+        out.remove();
+    if( !m_tailFile.open(QIODevice::ReadWrite) || !success )
+        return false;
+
+    // Left for sync() to seal if it's grown enough:
+    m_tail = rows;
+    m_dirty = true;
+    return true;
+}
+
+bool SegmentSeries::put(const HistoryRow &row, int conflict)
+{
+    if( !m_tailFile.isOpen() && !load() )
+        return false;
+
+    qint64 sealed = m_blocks.isEmpty() ? std::numeric_limits< qint64 >::min() : m_blocks.last().lastStart;
+    qint64 last = m_tail.isEmpty() ? sealed : m_tail.last().tstart;
+
+    // In order, as nearly all are:
+    if( row.tstart > last )
+    {
+        m_tailFile.seek( m_tailFile.size() );
+        if( m_tailFile.write( tailRecord(row) ) != SEGMENT_TAIL_RECORD )
+            return false;
+
+        m_tail.append(row);
+        m_dirty = true;
+        return true;
+    }
+
+    // Late, but not sealed yet:
+    if( row.tstart > sealed )
+    {
+        QList< HistoryRow > rows = m_tail;
+        if( !place(rows, row, conflict) )
+            return true;
+        return writeTail(rows);
+    }
+
+    // In a sealed block. It and every block after it are written again:
+    int first = 0;
+    while( first < m_blocks.length() && m_blocks[first].lastStart < row.tstart )
+        first++;
+
+    QList< HistoryRow > rows;
+    for( int x=first; x < m_blocks.length(); x++ )
+    {
+        // Rather not rewrite a damaged block than lose what's left of it:
+        QList< HistoryRow > decoded = decode(m_blocks[x], device, reg);
+        if( decoded.length() != m_blocks[x].count )
+            return false;
+        rows.append(decoded);
+    }
+
+    if( !place(rows, row, conflict) )
+        return true;
+
+    QByteArray blocks;
+    for( int x=0; x < rows.length(); x += SEGMENT_BLOCK_ROWS )
+        blocks.append( encode( rows.mid(x, SEGMENT_BLOCK_ROWS) ) );
+    return publish( 0, m_blocks[first].offset, blocks );
+}
+
+bool SegmentSeries::sync()
+{
+    if( !m_dirty )
+        return true;
+
+    if( !m_tailFile.flush() || ::fsync( m_tailFile.handle() ) != 0 )
+        return false;
+    m_dirty = false;
+
+    if( m_tail.length() >= SEGMENT_BLOCK_ROWS )
+        return seal();
+    return true;
+}
+
+QByteArray SegmentSeries::encode(const QList< HistoryRow > &rows) const
+{
+    BitWriter columns[SEGMENT_COLUMNS];
+    DeltaEncoder startEncoder, lengthEncoder, samplesEncoder;
+    XorEncoder minEncoder, maxEncoder, averageEncoder;
+    foreach( const HistoryRow &row, rows )
+    {
+        startEncoder.encode( columns[0], row.tstart );
+        lengthEncoder.encode( columns[1], row.tend - row.tstart );
+        minEncoder.encode( columns[2], row.min );
+        maxEncoder.encode( columns[3], row.max );
+        averageEncoder.encode( columns[4], row.average );
+        samplesEncoder.encode( columns[5], row.samples );
+    }
+
+    QByteArray payload;
+    QDataStream ps(&payload, QIODevice::WriteOnly);
+    ps.setByteOrder(QDataStream::LittleEndian);
+    for( int x=0; x < SEGMENT_COLUMNS; x++ )
+    {
+        ps << (quint32)columns[x].data().size();
+        ps.writeRawData( columns[x].data().constData(), columns[x].data().size() );
+    }
+
+    QByteArray block;
+    QDataStream bs(&block, QIODevice::WriteOnly);
+    bs.setByteOrder(QDataStream::LittleEndian);
+    bs << (quint32)SEGMENT_MAGIC << (quint16)rows.length() << qChecksum( payload.constData(), payload.size() );
+    bs << rows.first().tstart << rows.last().tstart << (quint32)payload.size();
+    block.append(payload);
+    return block;
+}
+
+bool SegmentSeries::publish(qint64 from, qint64 to, const QByteArray &blocks)
+{
+    // Readers have the segment mapped, and cutting a mapped file short makes
+    // them fault. So it's never touched in place: bytes [from, to) of the
+    // current one and then 'blocks' go to a new file that's renamed over it,
+    // and the old one lives on for as long as anyone has it mapped.
+    QString path = m_base + ".seg";
+    QFile out( path + ".new" );
+    if( !out.open(QIODevice::WriteOnly | QIODevice::Truncate) )
+        return false;
+
+    qint64 length = to - from;
+    if( ( length > 0 && out.write( (const char*)m_map + from, length ) != length ) ||
+        out.write(blocks) != blocks.size() || !out.flush() || ::fsync( out.handle() ) != 0 )
+    {
+        out.remove();
+        return false;
+    }
+    out.close();
+
+    // Not mapped while it's swapped out from under us:
+    close();
+    if( ::rename( QFile::encodeName(out.fileName()).constData(), QFile::encodeName(path).constData() ) != 0 )
+    {
+        out.remove();
+        refresh();
+        return false;
+    }
+
+    refresh();
+    return true;
+}
+
+bool SegmentSeries::seal()
+{
+    // The blocks sealed so far are copied from the map, it has to be current:
+    if( !refresh() && QFile::exists( m_base + ".seg" ) )
+        return false;
+    if( !publish( 0, m_indexed, encode(m_tail) ) )
+        return false;
+
+    // Only once the block is safely down; a crash before this is tidied up by load():
+    m_tail.clear();
+    m_tailFile.resize(0);
+    ::fsync( m_tailFile.handle() );
+    return true;
+}
+
+bool SegmentSeries::dropBefore(qint64 whence)
+{
+    refresh();
+
+    int keep = 0;
+    while( keep < m_blocks.length() && m_blocks[keep].lastStart < whence )
+        keep++;
+    if( keep == 0 )
+        return true;
+
+    qint64 offset = keep < m_blocks.length() ? m_blocks[keep].offset : m_indexed;
+    return publish( offset, m_indexed, QByteArray() );
+}
+
+SegmentStore::SegmentStore(QSettings *settings) :
+    m_open(false),
+    m_state(nullptr)
+{
+    m_path = settings->value("historyPath", "/var/lib/epsolar/history").toString();
+    m_chunkHours = qMax( 1, settings->value("compactionChunkHours", 6).toInt() );
+}
+
+SegmentStore::~SegmentStore()
+{
+    qDeleteAll(m_series);
+    delete m_state;
+}
+
+bool SegmentStore::open()
+{
+    if( m_open )
+        return true;
+
+    for( int tier=0; tier < TIER_COUNT; tier++ )
+    {
+        if( !QDir().mkpath( tierPath(tier) ) )
+        {
+            m_error = "Can't create " + tierPath(tier);
+            return false;
+        }
+    }
+
+    m_state = new QSettings( m_path + "/compaction.ini", QSettings::IniFormat );
+    m_open = true;
+    return true;
+}
+
+QString SegmentStore::tierPath(int tier) const
+{
+    // Named after the tables the SQL backend keeps them in:
+    static const char *names[TIER_COUNT] = { "fiveMinute", "hourly", "daily", "monthly" };
+    return m_path + "/" + names[tier];
+}
+
+SegmentSeries *SegmentStore::series(int tier, quint16 device, quint16 reg)
+{
+    QString base = QString("%1/%2-%3").arg( tierPath(tier) ).arg(device).arg(reg);
+    SegmentSeries *series = m_series.value(base);
+    if( !series )
+    {
+        series = new SegmentSeries(base, device, reg);
+        m_series.insert(base, series);
+    }
+    return series;
+}
+
+QList< SegmentSeries* > SegmentStore::list(int tier, int device)
+{
+    // The files are the catalogue, the other thread's store adds to it:
+    QList< SegmentSeries* > found;
+    QDir dir( tierPath(tier) );
+    foreach( const QString &file, dir.entryList( QStringList() << "*.seg" << "*.tail", QDir::Files ) )
+    {
+        QStringList parts = file.section('.', 0, 0).split('-');
+        if( parts.length() != 2 )
+            continue;
+
+        bool ok1, ok2;
+        int id = parts[0].toInt(&ok1);
+        int reg = parts[1].toInt(&ok2);
+        if( !ok1 || !ok2 || ( device >= 0 && id != device ) )
+            continue;
+
+        SegmentSeries *s = series(tier, id, reg);
+        if( !found.contains(s) )
+            found.append(s);
+    }
+
+    std::sort( found.begin(), found.end(), []( const SegmentSeries *a, const SegmentSeries *b ) {
+        return a->reg != b->reg ? a->reg < b->reg : a->device < b->device;
+    } );
+    return found;
+}
+
+qint64 SegmentStore::bucket(int tier, qint64 whence) const
+{
+    QDateTime t = QDateTime::fromMSecsSinceEpoch(whence);
+    if( tier == TIER_HOUR )
+        t = QDateTime( t.date(), QTime( t.time().hour(), 0 ) );
+    else if( tier == TIER_DAY )
+        t = QDateTime( t.date(), QTime(0, 0) );
+    else if( tier == TIER_MONTH )
+        t = QDateTime( QDate( t.date().year(), t.date().month(), 1 ), QTime(0, 0) );
+    return t.toMSecsSinceEpoch();
+}
+
+void SegmentStore::rewind(const QString &name, qint64 watermark)
+{
+    // Never forward, and not at all before the first run sets one:
+    qint64 current = m_state->value(name, -1).toLongLong();
+    if( current > watermark )
+        m_state->setValue(name, watermark);
+}
+
+bool SegmentStore::write(const QList< HistoryRow > &rows, HistorySpan *merged)
+{
+    merged->tier = -1;
+    if( !m_open )
+        return false;
+
+    // The five-minute rows of hours below the watermark are gone, so a late
+    // one goes straight into its hour, as the SQL backend's compaction does:
+    qint64 hours = m_state->value("hourly", -1).toLongLong();
+    QList< SegmentSeries* > touched;
+    foreach( const HistoryRow &row, rows )
+    {
+        SegmentSeries *s;
+        bool success;
+        if( hours >= 0 && row.tstart < hours )
+        {
+            HistoryRow hour = row;
+            hour.tstart = bucket(TIER_HOUR, row.tstart);
+            s = series(TIER_HOUR, row.device, row.reg);
+            success = s->put(hour, SEGMENT_MERGE);
+
+            merged->from = merged->tier < 0 ? hour.tstart : qMin( merged->from, hour.tstart );
+            merged->to = merged->tier < 0 ? hour.tend : qMax( merged->to, hour.tend );
+            merged->tier = TIER_HOUR;
+
+            // Its day and month are redone by the next compaction:
+            rewind( "daily", bucket(TIER_DAY, hour.tstart) );
+            rewind( "monthly", bucket(TIER_MONTH, hour.tstart) );
+        }
+        else
+        {
+            s = series(TIER_FIVE_MINUTES, row.device, row.reg);
+            success = s->put(row, SEGMENT_KEEP);
+        }
+
+        if( !success )
+        {
+            m_error = "Can't write to history of register " + QString::number(row.reg);
+            return false;
+        }
+        if( !touched.contains(s) )
+            touched.append(s);
+    }
+
+    if( merged->tier >= 0 )
+    {
+        m_state->sync();
+        if( m_state->status() != QSettings::NoError )
+        {
+            m_error = "Can't save the compaction watermarks";
+            return false;
+        }
+    }
+
+    // One fsync per series for the lot:
+    foreach( SegmentSeries *s, touched )
+    {
+        if( !s->sync() )
+        {
+            m_error = "Can't sync history of register " + QString::number(s->reg);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool SegmentStore::compact(bool *done, HistorySpan *compacted)
+{
+    *done = true;
+    compacted->tier = -1;
+    if( !m_open )
+        return false;
+
+    // Hours are only compacted once they're over 24 hours old, and each tier
+    // only takes what the one below it has finished:
+    QDateTime now = QDateTime::currentDateTime();
+    qint64 cutoff = QDateTime( now.date(), QTime( now.time().hour(), 0 ) ).addSecs( -24 * 3600 ).toMSecsSinceEpoch();
+    if( !compactTier( TIER_HOUR, "hourly", cutoff, done, compacted ) )
+        return false;
+    if( !*done )
+        return true;
+
+    qint64 hours = m_state->value("hourly", -1).toLongLong();
+    if( hours < 0 )
+        return true;
+    if( !compactTier( TIER_DAY, "daily", bucket(TIER_DAY, hours), done, compacted ) )
+        return false;
+    if( !*done )
+        return true;
+
+    qint64 days = m_state->value("daily", -1).toLongLong();
+    if( days < 0 )
+        return true;
+    return compactTier( TIER_MONTH, "monthly", bucket(TIER_MONTH, days), done, compacted );
+}
+
+bool SegmentStore::compactTier(int tier, const QString &name, qint64 cutoff, bool *done, HistorySpan *compacted)
+{
+    *done = false;
+    QList< SegmentSeries* > sources = list(tier - 1, -1);
+
+    // Rows arriving below the watermark are merged by write(), or redone
+    // from their day or month. The first run starts from the oldest source row:
+    qint64 from = m_state->value(name, -1).toLongLong();
+    if( from < 0 )
+    {
+        foreach( SegmentSeries *s, sources )
+        {
+            qint64 first = s->firstStart();
+            if( first >= 0 && ( from < 0 || first < from ) )
+                from = first;
+        }
+        if( from >= 0 )
+            from = bucket(tier, from);
+    }
+
+    if( from < 0 || from >= cutoff )
+    {
+        *done = true;
+        return true;
+    }
+
+    // One bounded chunk per pass, the rest is picked up on the next:
+    QDateTime start = QDateTime::fromMSecsSinceEpoch(from);
+    QDateTime end = tier == TIER_HOUR ? start.addSecs( m_chunkHours * 3600 ) : tier == TIER_DAY ? start.addDays(31) : start.addMonths(12);
+    qint64 to = qMin( end.toMSecsSinceEpoch(), cutoff );
+
+    QList< SegmentSeries* > touched;
+    foreach( SegmentSeries *s, sources )
+    {
+        QList< HistoryRow > rows = s->rows(from, to);
+        for( int first=0; first < rows.length(); )
+        {
+            HistoryRow out = rows[first];
+            out.tstart = bucket(tier, rows[first].tstart);
+            out.samples = 0;
+            double sum = 0;
+            int last = first;
+            for( ; last < rows.length() && bucket(tier, rows[last].tstart) == out.tstart; last++ )
+            {
+                out.min = qMin( out.min, rows[last].min );
+                out.max = qMax( out.max, rows[last].max );
+                out.tend = qMax( out.tend, rows[last].tend );
+                out.samples += rows[last].samples;
+                sum += rows[last].average;
+            }
+            out.average = sum / ( last - first );
+            first = last;
+
+            SegmentSeries *target = series(tier, out.device, out.reg);
+            // An hour already there took late rows, a day or month is redone whole:
+            if( !target->put( out, tier == TIER_HOUR ? SEGMENT_MERGE : SEGMENT_REPLACE ) )
+            {
+                m_error = "Can't append to " + name + " history";
+                return false;
+            }
+            if( !touched.contains(target) )
+                touched.append(target);
+        }
+    }
+
+    foreach( SegmentSeries *s, touched )
+    {
+        if( !s->sync() )
+        {
+            m_error = "Can't sync " + name + " history";
+            return false;
+        }
+    }
+
+    // Five-minute rows aren't kept once they're in an hour, a block at a time:
+    if( tier == TIER_HOUR )
+    {
+        foreach( SegmentSeries *s, sources )
+            s->dropBefore(to);
+    }
+
+    m_state->setValue(name, to);
+    m_state->sync();
+    if( m_state->status() != QSettings::NoError )
+    {
+        m_error = "Can't save the " + name + " watermark";
+        return false;
+    }
+
+    qDebug() << "Compacted" << name << start.toString(Qt::ISODate) << "-" << QDateTime::fromMSecsSinceEpoch(to).toString(Qt::ISODate);
+    compacted->tier = tier;
+    compacted->from = from;
+    compacted->to = to;
+    *done = to >= cutoff;
+    return true;
+}
+
+QList< HistoryRow > SegmentStore::read(int tier, quint16 device, qint64 from, qint64 to, const QList< quint16 > &regs, quint32 limit)
+{
+    QList< HistoryRow > rows;
+    if( !m_open || tier < 0 || tier >= TIER_COUNT )
+        return rows;
+
+    foreach( SegmentSeries *s, list(tier, device) )
+    {
+        if( !regs.isEmpty() && !regs.contains(s->reg) )
+            continue;
+
+        // Five-minute and hourly rows have to have ended by 'to', calendar rows only started:
+        foreach( const HistoryRow &row, s->rows(from, to) )
+        {
+            if( tier <= TIER_HOUR && row.tend > to )
+                continue;
+
+            rows.append(row);
+            if( (quint32)rows.length() >= limit )
+                return rows;
+        }
+    }
+
+    return rows;
+}
@@ -0,0 +1,110 @@
+#ifndef SEGMENTSTORE_H
+#define SEGMENTSTORE_H
+
+#include <QFile>
+#include <QHash>
+#include <QSettings>
+#include <QVector>
+
+#include "historystore.h"
+
+// Rows gathered in a series' tail before they're sealed into a compressed block:
+#define SEGMENT_BLOCK_ROWS 64
+
+// What put() does with a row starting at the same time as one already there:
+#define SEGMENT_KEEP 0          // Leaves the one there, replaying rows is harmless.
+#define SEGMENT_MERGE 1         // Folds them together, weighted by samples.
+#define SEGMENT_REPLACE 2       // Takes the new one, a bucket recomputed from its source.
+
+struct SegmentBlock
+{
+    qint64      offset;     // Of the block header in the segment file.
+    int         count;
+    int         bytes;      // Payload, after the header.
+    qint64      firstStart;
+    qint64      lastStart;
+};
+
+// One register of one device at one tier: sealed blocks in <base>.seg, rows
+// not yet sealed in <base>.tail. Only the PersistWorker's store writes, the
+// Controller's maps the files and picks up new blocks as they're sealed. A
+// segment is replaced whole, never changed in place.
+class SegmentSeries
+{
+    QString         m_base;
+    QFile           m_segment;
+    quint64         m_inode;    // Compaction replaces the file, this notices.
+    uchar           *m_map;
+    qint64          m_mapped;
+    qint64          m_indexed;  // Bytes of the segment covered by m_blocks.
+    QVector< SegmentBlock > m_blocks;
+    bool            m_damaged;
+
+    // Writer side:
+    QFile           m_tailFile;
+    QList< HistoryRow > m_tail;
+    bool            m_dirty;
+
+    void close();
+    bool refresh();
+    QList< HistoryRow > decode(const SegmentBlock &block, quint16 device, quint16 reg) const;
+    QList< HistoryRow > readTail();
+    bool writeTail(const QList< HistoryRow > &rows);
+    QByteArray encode(const QList< HistoryRow > &rows) const;
+    bool publish(qint64 from, qint64 to, const QByteArray &blocks);
+    bool load();
+    bool seal();
+
+public:
+    quint16         device;
+    quint16         reg;
+
+    SegmentSeries(const QString &base, quint16 device, quint16 reg);
+    ~SegmentSeries();
+
+    // Rows starting in [from, to), oldest first:
+    QList< HistoryRow > rows(qint64 from, qint64 to);
+    qint64 firstStart();
+
+    // Writer side. Rows are kept in order of their start: one that belongs
+    // before the last is put in its place, rewriting the tail or the blocks
+    // from the one it falls in. 'conflict' is one of the SEGMENT_ values:
+    bool put(const HistoryRow &row, int conflict);
+    bool sync();
+    bool dropBefore(qint64 whence);
+};
+
+// History in per-series files under "historyPath": timestamps delta-of-delta
+// and values XOR encoded, in blocks indexed by their time range. Compaction
+// watermarks live next to them in compaction.ini.
+class SegmentStore : public HistoryStore
+{
+    QString         m_path;
+    int             m_chunkHours;
+    bool            m_open;
+    QString         m_error;
+    QSettings       *m_state;
+
+    QHash< QString, SegmentSeries* > m_series;
+
+    QString tierPath(int tier) const;
+    SegmentSeries *series(int tier, quint16 device, quint16 reg);
+    QList< SegmentSeries* > list(int tier, int device);
+    qint64 bucket(int tier, qint64 whence) const;
+    void rewind(const QString &name, qint64 watermark);
+    bool compactTier(int tier, const QString &name, qint64 cutoff, bool *done, HistorySpan *compacted);
+
+public:
+    explicit SegmentStore(QSettings *settings);
+    ~SegmentStore();
+
+    bool open();
+    bool isOpen() const { return m_open; }
+    QString errorString() const { return m_error; }
+
+    bool write(const QList< HistoryRow > &rows, HistorySpan *merged);
+    bool compact(bool *done, HistorySpan *compacted);
+    QList< HistoryRow > read(int tier, quint16 device, qint64 from, qint64 to, const QList< quint16 > &regs, quint32 limit);
+};
+
+#endif // SEGMENTSTORE_H
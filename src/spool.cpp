@@ -0,0 +1,104 @@
+#include "spool.h"
+
+#include <QByteArray>
+#include <QDataStream>
+#include <QDebug>
+
+#include <unistd.h>
+
+#define SPOOL_MAGIC 0x45505331  // "EPS1"
+
+Spool::Spool() :
+    m_maxBytes(0),
+    m_corrupt(0)
+{
+}
+
+bool Spool::open(const QString &path, qint64 maxBytes)
+{
+    m_maxBytes = maxBytes;
+    m_file.setFileName(path);
+    if( !m_file.open(QIODevice::ReadWrite) )
+        return false;
+
+    // Whatever a crash cut short can't be read back, start after the last whole record:
+    qint64 whole = m_file.size() - ( m_file.size() % SPOOL_RECORD_SIZE );
+    if( whole != m_file.size() )
+    {
+        qWarning() << "Spool ends in a partial record, truncating: " << path;
+        m_file.resize(whole);
+    }
+    return true;
+}
+
+bool Spool::append(const HistoryRow &row)
+{
+    if( !m_file.isOpen() )
+        return false;
+
+    if( m_maxBytes > 0 && m_file.size() + SPOOL_RECORD_SIZE > m_maxBytes )
+        return false;
+
+    QByteArray record;
+    QDataStream ds(&record, QIODevice::WriteOnly);
+    ds.setByteOrder(QDataStream::LittleEndian);
+    ds << (quint32)SPOOL_MAGIC << row.device << row.reg << row.min << row.max << row.average << row.tstart << row.tend;
+    ds << qChecksum( record.constData(), record.size() );
+
+    m_file.seek( m_file.size() );
+    return m_file.write(record) == SPOOL_RECORD_SIZE;
+}
+
+bool Spool::sync()
+{
+    if( !m_file.isOpen() )
+        return false;
+
+    // One fsync for however many records went in since the last one:
+    if( !m_file.flush() )
+        return false;
+    return ::fsync( m_file.handle() ) == 0;
+}
+
+QList< HistoryRow > Spool::read(qint64 &offset, int max)
+{
+    QList< HistoryRow > rows;
+    if( !m_file.isOpen() || !m_file.seek(offset) )
+        return rows;
+
+    while( rows.length() < max && offset + SPOOL_RECORD_SIZE <= m_file.size() )
+    {
+        QByteArray record = m_file.read(SPOOL_RECORD_SIZE);
+        if( record.size() != SPOOL_RECORD_SIZE )
+            break;
+        offset += SPOOL_RECORD_SIZE;
+
+        QDataStream ds(record);
+        ds.setByteOrder(QDataStream::LittleEndian);
+
+        quint32 magic;
+        quint16 checksum;
+        HistoryRow row;
+        ds >> magic >> row.device >> row.reg >> row.min >> row.max >> row.average >> row.tstart >> row.tend >> checksum;
+
+        if( magic != SPOOL_MAGIC || checksum != qChecksum( record.constData(), SPOOL_RECORD_SIZE - 2 ) )
+        {
+            m_corrupt++;
+            qWarning() << "Skipping corrupt spool record, " << m_corrupt << "so far";
+            continue;
+        }
+
+        rows.append(row);
+    }
+
+    return rows;
+}
+
+void Spool::clear()
+{
+    if( !m_file.isOpen() )
+        return;
+
+    m_file.resize(0);
+    sync();
+}
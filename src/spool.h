@@ -0,0 +1,41 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <QFile>
+#include <QList>
+#include <QString>
+
+#include "historystore.h"
+
+// On-disk size of one record: magic, device, register, min, max, average,
+// tstart, tend and a CRC-16 of the rest.
+#define SPOOL_RECORD_SIZE 50
+
+// Append-only file of finished buckets not yet known to be in the database.
+// Records are fixed-size and checksummed, so a torn or damaged one is
+// skipped on replay rather than poisoning the rest.
+class Spool
+{
+    QFile           m_file;
+    qint64          m_maxBytes;
+    quint32         m_corrupt;
+
+public:
+    Spool();
+
+    bool open(const QString &path, qint64 maxBytes);
+    bool isOpen() const { return m_file.isOpen(); }
+    QString errorString() const { return m_file.errorString(); }
+
+    // Buffered, sync() makes everything appended so far durable:
+    bool append(const HistoryRow &row);
+    bool sync();
+
+    // Reads up to 'max' records from 'offset' on, moving it past them:
+    QList< HistoryRow > read(qint64 &offset, int max);
+
+    qint64 size() const { return m_file.isOpen() ? m_file.size() : 0; }
+    void clear();
+};
+
+#endif // SPOOL_H
@@ -0,0 +1,49 @@
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include <atomic>
+
+// Bounded lock-free queue for exactly one producer thread and one consumer
+// thread. Holds up to N-1 items; push() fails rather than blocks when full.
+template< typename T, unsigned int N >
+class SpscRing
+{
+    T                           m_items[N];
+    std::atomic< unsigned int > m_head;     // Next slot to write, owned by the producer.
+    std::atomic< unsigned int > m_tail;     // Next slot to read, owned by the consumer.
+
+public:
+    SpscRing() : m_head(0), m_tail(0) {}
+
+    bool push(const T &item)
+    {
+        unsigned int head = m_head.load(std::memory_order_relaxed);
+        unsigned int next = ( head + 1 ) % N;
+        if( next == m_tail.load(std::memory_order_acquire) )
+            return false;
+
+        m_items[head] = item;
+        m_head.store(next, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &item)
+    {
+        unsigned int tail = m_tail.load(std::memory_order_relaxed);
+        if( tail == m_head.load(std::memory_order_acquire) )
+            return false;
+
+        item = m_items[tail];
+        m_tail.store(( tail + 1 ) % N, std::memory_order_release);
+        return true;
+    }
+
+    unsigned int size() const
+    {
+        unsigned int head = m_head.load(std::memory_order_acquire);
+        unsigned int tail = m_tail.load(std::memory_order_acquire);
+        return ( head + N - tail ) % N;
+    }
+};
+
+#endif // SPSCRING_H
@@ -0,0 +1,372 @@
+#include "sqlstore.h"
+
+#include <QDebug>
+#include <QSqlError>
+#include <QStringList>
+
+SqlStore::SqlStore(QSettings *settings, const QString &connection) :
+    m_connection(connection)
+{
+    m_type = settings->value("databaseType", "QMYSQL").toString();
+    m_name = settings->value("databaseName", "epsolar").toString();
+    m_hostname = settings->value("databaseHostname", "localhost").toString();
+    m_username = settings->value("databaseUsername", "root").toString();
+    m_password = settings->value("databasePassword", "").toString();
+    m_chunkHours = qMax( 1, settings->value("compactionChunkHours", 6).toInt() );
+}
+
+bool SqlStore::open()
+{
+    if( m_db.isOpen() )
+        return true;
+
+    // Made on first use, by the thread that's going to use it:
+    if( !m_db.isValid() )
+    {
+        m_db = QSqlDatabase::addDatabase(m_type, m_connection);
+        m_db.setDatabaseName(m_name);
+        m_db.setHostName(m_hostname);
+        m_db.setUserName(m_username);
+        m_db.setPassword(m_password);
+    }
+
+    return m_db.open();
+}
+
+QString SqlStore::errorString() const
+{
+    return m_db.lastError().text();
+}
+
+void SqlStore::disconnect()
+{
+    // The connection may have been lost, reconnect and prepare afresh next time:
+    m_inserts.clear();
+    m_db.close();
+}
+
+bool SqlStore::write(const QList< HistoryRow > &rows, HistorySpan *merged)
+{
+    // Late rows are merged into their hour by compressHourly():
+    merged->tier = -1;
+    if( rows.isEmpty() )
+        return true;
+
+    if( !m_db.transaction() )
+    {
+        qWarning() << "Failed to open an averages transaction: " << m_db.lastError();
+        disconnect();
+        return false;
+    }
+
+    bool success = true;
+    for( int first=0; first < rows.length() && success; first += SQL_MAX_ROWS )
+    {
+        int count = qMin( SQL_MAX_ROWS, rows.length() - first );
+
+        // Each batch size is only prepared once, in practice there's one or two:
+        if( !m_inserts.contains(count) )
+        {
+            QStringList values;
+            for( int x=0; x < count; x++ )
+                values.append("(?, ?, ?, ?, ?, ?, ?)");
+
+            QSqlQuery query(m_db);
+            if( !query.prepare("INSERT IGNORE INTO fiveMinute(device, register, min, max, average, tstart, tend)VALUES" + values.join(", ")) )
+            {
+                success = false;
+                break;
+            }
+            m_inserts.insert( count, query );
+        }
+
+        QSqlQuery &query = m_inserts[count];
+        for( int x=0; x < count; x++ )
+        {
+            const HistoryRow &row = rows[first + x];
+            query.addBindValue(row.device);
+            query.addBindValue(row.reg);
+            query.addBindValue(row.min);
+            query.addBindValue(row.max);
+            query.addBindValue(row.average);
+            query.addBindValue( QDateTime::fromMSecsSinceEpoch(row.tstart) );
+            query.addBindValue( QDateTime::fromMSecsSinceEpoch(row.tend) );
+        }
+
+        if( !query.exec() )
+            success = false;
+    }
+
+    if( success )
+        success = m_db.commit();
+
+    if( !success )
+    {
+        qWarning() << "Transaction failed, kept for a retry: " << m_db.lastError();
+        m_db.rollback();
+        disconnect();
+        return false;
+    }
+
+    return true;
+}
+
+bool SqlStore::compact(bool *done, HistorySpan *compacted)
+{
+    compacted->tier = -1;
+
+    // Each tier only takes what the one below it has finished:
+    if( !compressHourly(done, compacted) )
+        return false;
+    if( !*done )
+        return true;
+
+    QDateTime hours = watermark("hourly");
+    if( hours.isValid() )
+        hours = QDateTime( hours.date(), QTime(0, 0) );
+    if( !compactCalendar( "daily", "hourly", false, hours, done, compacted ) )
+        return false;
+    if( !*done )
+        return true;
+
+    QDateTime days = watermark("daily");
+    if( days.isValid() )
+        days = QDateTime( QDate( days.date().year(), days.date().month(), 1 ), QTime(0, 0) );
+    return compactCalendar( "monthly", "daily", true, days, done, compacted );
+}
+
+bool SqlStore::compressHourly(bool *done, HistorySpan *compacted)
+{
+    *done = false;
+
+    // Hours are only compacted once they're over 24 hours old:
+    QDateTime now = QDateTime::currentDateTime();
+    QDateTime cutoff = QDateTime( now.date(), QTime( now.time().hour(), 0 ) ).addSecs( -24 * 3600 );
+
+    QSqlQuery query(m_db);
+    QDateTime watermark = this->watermark("hourly");
+
+    // Anything left below the watermark came in late (from the spool), start there instead:
+    if( !query.exec("SELECT MIN(tstart) FROM fiveMinute") )
+        return false;
+    QDateTime oldest;
+    if( query.next() && !query.value(0).isNull() )
+    {
+        oldest = query.value(0).toDateTime();
+        oldest = QDateTime( oldest.date(), QTime( oldest.time().hour(), 0 ) );
+    }
+
+    QDateTime from = watermark;
+    if( oldest.isValid() && ( !from.isValid() || oldest < from ) )
+        from = oldest;
+
+    if( !from.isValid() || from >= cutoff )
+    {
+        *done = true;
+        return true;
+    }
+
+    // One bounded chunk per transaction, the rest is picked up on the next pass:
+    QDateTime to = qMin( from.addSecs( m_chunkHours * 3600 ), cutoff );
+
+    if( !m_db.transaction() )
+        return false;
+
+    // Late rows for an hour that's already there are merged into it, weighted by how many went into each:
+    bool success = query.prepare("INSERT INTO hourly(device, register, min, max, average, samples, tstart, tend) SELECT device, register, MIN(min) AS min, MAX(max) AS max, AVG(average) AS average, COUNT(*) AS samples, DATE_FORMAT(MIN(tstart), '%Y-%m-%d %H:00:00') AS tstart, MAX(tend) AS tend FROM fiveMinute WHERE tstart >= ? AND tstart < ? GROUP BY DATE(tstart), HOUR(tstart), device, register "
+                                 "ON DUPLICATE KEY UPDATE average = ( average * samples + VALUES(average) * VALUES(samples) ) / ( samples + VALUES(samples) ), samples = samples + VALUES(samples), "
+                                 "min = LEAST(min, VALUES(min)), max = GREATEST(max, VALUES(max)), tend = GREATEST(tend, VALUES(tend))");
+    if( success )
+    {
+        query.addBindValue(from);
+        query.addBindValue(to);
+        success = query.exec();
+    }
+
+    // Those hours may already be rolled up further, their days and months are redone:
+    if( success && watermark.isValid() && from < watermark )
+    {
+        QDate day = from.date();
+        success = rewindWatermark( "daily", QDateTime( day, QTime(0, 0) ) ) &&
+                  rewindWatermark( "monthly", QDateTime( QDate( day.year(), day.month(), 1 ), QTime(0, 0) ) );
+    }
+
+    if( success )
+        success = query.prepare("DELETE FROM fiveMinute WHERE tstart < ?");
+    if( success )
+    {
+        query.addBindValue(to);
+        success = query.exec();
+    }
+
+    if( success )
+        success = setWatermark( "hourly", watermark.isValid() && watermark > to ? watermark : to );
+
+    if( success )
+        success = m_db.commit();
+
+    if( !success )
+    {
+        qWarning() << "Hourly compaction failed: " << m_db.lastError() << query.lastError();
+        m_db.rollback();
+        return false;
+    }
+
+    qDebug() << "Compacted hours" << from.toString(Qt::ISODate) << "-" << to.toString(Qt::ISODate);
+    compacted->tier = TIER_HOUR;
+    compacted->from = from.toMSecsSinceEpoch();
+    compacted->to = to.toMSecsSinceEpoch();
+    *done = to >= cutoff;
+    return true;
+}
+
+bool SqlStore::compactCalendar(const QString &table, const QString &source, bool monthly, const QDateTime &cutoff, bool *done, HistorySpan *compacted)
+{
+    *done = false;
+    if( !cutoff.isValid() )
+    {
+        *done = true;
+        return true;
+    }
+
+    QDateTime from = watermark(table);
+    if( !from.isValid() )
+    {
+        // First run, start from the oldest source row:
+        QSqlQuery query(m_db);
+        if( !query.exec("SELECT MIN(tstart) FROM " + source) )
+            return false;
+        if( query.next() && !query.value(0).isNull() )
+        {
+            QDate oldest = query.value(0).toDate();
+            if( monthly )
+                oldest = QDate( oldest.year(), oldest.month(), 1 );
+            from = QDateTime( oldest, QTime(0, 0) );
+        }
+    }
+
+    if( !from.isValid() || from >= cutoff )
+    {
+        *done = true;
+        return true;
+    }
+
+    // A year of months or a month of days per transaction:
+    QDateTime to = qMin( monthly ? from.addMonths(12) : from.addDays(31), cutoff );
+    QString bucket = monthly ? "DATE_FORMAT(MIN(tstart), '%Y-%m-01')" : "DATE(MIN(tstart))";
+    QString group = monthly ? "YEAR(tstart), MONTH(tstart)" : "DATE(tstart)";
+
+    if( !m_db.transaction() )
+        return false;
+
+    QSqlQuery query(m_db);
+    // Whole days or months are always recomputed from their source, so a redone one replaces the old:
+    bool success = query.prepare( QString("INSERT INTO %1(device, register, min, max, average, tstart, tend) SELECT device, register, MIN(min) AS min, MAX(max) AS max, AVG(average) AS average, %2 AS tstart, MAX(tend) AS tend FROM %3 WHERE tstart >= ? AND tstart < ? GROUP BY %4, device, register "
+                                          "ON DUPLICATE KEY UPDATE min = VALUES(min), max = VALUES(max), average = VALUES(average), tend = VALUES(tend)").arg(table, bucket, source, group) );
+    if( success )
+    {
+        query.addBindValue(from);
+        query.addBindValue(to);
+        success = query.exec();
+    }
+
+    if( success )
+        success = setWatermark(table, to);
+
+    if( success )
+        success = m_db.commit();
+
+    if( !success )
+    {
+        qWarning() << "Compaction into" << table << "failed: " << m_db.lastError() << query.lastError();
+        m_db.rollback();
+        return false;
+    }
+
+    qDebug() << "Compacted" << table << from.toString(Qt::ISODate) << "-" << to.toString(Qt::ISODate);
+    compacted->tier = monthly ? TIER_MONTH : TIER_DAY;
+    compacted->from = from.toMSecsSinceEpoch();
+    compacted->to = to.toMSecsSinceEpoch();
+    *done = to >= cutoff;
+    return true;
+}
+
+QDateTime SqlStore::watermark(const QString &name)
+{
+    QSqlQuery query(m_db);
+    if( !query.prepare("SELECT watermark FROM compaction WHERE name = ?") )
+        return QDateTime();
+
+    query.addBindValue(name);
+    if( !query.exec() || !query.next() )
+        return QDateTime();
+    return query.value(0).toDateTime();
+}
+
+bool SqlStore::setWatermark(const QString &name, const QDateTime &watermark)
+{
+    QSqlQuery query(m_db);
+    if( !query.prepare("INSERT INTO compaction(name, watermark) VALUES(?, ?) ON DUPLICATE KEY UPDATE watermark = VALUES(watermark)") )
+        return false;
+
+    query.addBindValue(name);
+    query.addBindValue(watermark);
+    return query.exec();
+}
+
+bool SqlStore::rewindWatermark(const QString &name, const QDateTime &watermark)
+{
+    // Never forward, and not at all before the first run sets one:
+    QDateTime current = this->watermark(name);
+    if( !current.isValid() || current <= watermark )
+        return true;
+    return setWatermark(name, watermark);
+}
+
+QList< HistoryRow > SqlStore::read(int tier, quint16 device, qint64 from, qint64 to, const QList< quint16 > &regs, quint32 limit)
+{
+    QList< HistoryRow > rows;
+
+    static const char *tables[TIER_COUNT] = { "fiveMinute", "hourly", "daily", "monthly" };
+    if( tier < 0 || tier >= TIER_COUNT )
+        return rows;
+
+    QSqlQuery query(m_db);
+    // Numbers only, so they can go straight into the query:
+    QString args;
+    if( !regs.isEmpty() )
+    {
+        QStringList list;
+        foreach( quint16 reg, regs )
+            list.append( QString::number(reg) );
+        args = " AND register IN (" + list.join(",") + ")";
+    }
+
+    // Five-minute and hourly rows have to have ended by 'to', calendar rows only started:
+    QString end = tier <= TIER_HOUR ? "tend <= ?" : "tstart < ?";
+    QString queryStr = QString("SELECT register, min, max, average, tstart, tend FROM %1 WHERE device = ? AND tstart >= ? AND %2 %3 ORDER BY register, tstart LIMIT ?").arg(tables[tier], end, args);
+    if( !query.prepare(queryStr) )
+        return rows;
+
+    query.addBindValue(device);
+    query.addBindValue( QDateTime::fromMSecsSinceEpoch(from) );
+    query.addBindValue( QDateTime::fromMSecsSinceEpoch(to) );
+    query.addBindValue(limit);
+    if( !query.exec() )
+        return rows;
+
+    while( query.next() )
+    {
+        HistoryRow row;
+        row.device = device;
+        row.reg = query.value(0).toInt();
+        row.min = query.value(1).toReal();
+        row.max = query.value(2).toReal();
+        row.average = query.value(3).toReal();
+        row.tstart = query.value(4).toDateTime().toMSecsSinceEpoch();
+        row.tend = query.value(5).toDateTime().toMSecsSinceEpoch();
+        rows.append(row);
+    }
+
+    return rows;
+}
@@ -0,0 +1,49 @@
+#ifndef SQLSTORE_H
+#define SQLSTORE_H
+
+#include <QDateTime>
+#include <QHash>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+
+#include "historystore.h"
+
+// Largest number of rows put into one INSERT:
+#define SQL_MAX_ROWS 64
+
+// History kept in the fiveMinute, hourly, daily and monthly tables, with the
+// compaction watermarks in the compaction table.
+class SqlStore : public HistoryStore
+{
+    QSqlDatabase    m_db;
+    QString         m_connection;
+    QString         m_type;
+    QString         m_name;
+    QString         m_hostname;
+    QString         m_username;
+    QString         m_password;
+    int             m_chunkHours;   // Hours compacted per transaction.
+
+    // Prepared multi-row INSERTs, by row count:
+    QHash< int, QSqlQuery > m_inserts;
+
+    void disconnect();
+    bool compressHourly(bool *done, HistorySpan *compacted);
+    bool compactCalendar(const QString &table, const QString &source, bool monthly, const QDateTime &cutoff, bool *done, HistorySpan *compacted);
+    QDateTime watermark(const QString &name);
+    bool setWatermark(const QString &name, const QDateTime &watermark);
+    bool rewindWatermark(const QString &name, const QDateTime &watermark);
+
+public:
+    SqlStore(QSettings *settings, const QString &connection);
+
+    bool open();
+    bool isOpen() const { return m_db.isOpen(); }
+    QString errorString() const;
+
+    bool write(const QList< HistoryRow > &rows, HistorySpan *merged);
+    bool compact(bool *done, HistorySpan *compacted);
+    QList< HistoryRow > read(int tier, quint16 device, qint64 from, qint64 to, const QList< quint16 > &regs, quint32 limit);
+};
+
+#endif // SQLSTORE_H
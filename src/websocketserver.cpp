@@ -1,42 +1,174 @@
 #include "websocketserver.h"
+#include "wsclient.h"
+#include "wsframe.h"
 
-#include <QWebSocket>
+#include <QDateTime>
+#include <QDebug>
+#include <QJsonObject>
+#include <QTcpSocket>
 
-WebsocketServer::WebsocketServer(QObject *parent) : QObject(parent)
+WebsocketServer::WebsocketServer(QSettings *settings, QObject *parent) : QObject(parent),
+    m_server(nullptr),
+    m_nextId(1),
+    m_checkTimer(nullptr)
 {
-    m_server = new QWebSocketServer("Epsolar", QWebSocketServer::NonSecureMode, this);
+    m_port = settings->value("websocketPort", 7175).toInt();
 
-    connect( m_server, &QWebSocketServer::newConnection, this, &WebsocketServer::incoming );
-    m_server->listen(QHostAddress::Any, 7175);
+    // A client that can't keep up gets only the newest reading, and is
+    // dropped if it stays this far behind:
+    m_window = settings->value("websocketWindowKB", 64).toLongLong() * 1024;
+    m_highWaterBytes = settings->value("websocketHighWaterKB", 1024).toLongLong() * 1024;
+    m_highWaterMS = settings->value("websocketHighWaterMS", 5000).toLongLong();
+    m_behindLimitMS = settings->value("websocketBehindSeconds", 30).toLongLong() * 1000;
+
+    // permessage-deflate, for clients that offer it:
+    m_deflate.enabled = settings->value("websocketDeflate", true).toBool();
+    m_deflate.windowBits = qBound( 9, settings->value("websocketDeflateWindowBits", 12).toInt(), 15 );
+    m_deflate.memLevel = qBound( 1, settings->value("websocketDeflateMemLevel", 5).toInt(), 9 );
+    m_deflate.takeover = settings->value("websocketDeflateTakeover", true).toBool();
+
+    m_reportMS = settings->value("lagReportSeconds", 60).toInt() * 1000;
 }
 
-void WebsocketServer::incoming()
+void WebsocketServer::start()
 {
-    QWebSocket *socket = m_server->nextPendingConnection();
+    // Runs on the websocket thread, so the server, its sockets and the timer belong to it:
+    m_server = new QTcpServer(this);
+    connect( m_server, &QTcpServer::newConnection, this, &WebsocketServer::incoming );
+    if( !m_server->listen(QHostAddress::Any, m_port) )
+        qWarning() << "Websocket server can't listen on port" << m_port << m_server->errorString();
+
+    m_checkTimer = new QTimer(this);
+    m_checkTimer->setInterval(1000);
+    connect( m_checkTimer, &QTimer::timeout, this, &WebsocketServer::checkBacklog );
+    m_checkTimer->start();
+    m_reportClock.start();
+}
 
-    connect( socket, &QWebSocket::disconnected, this, &WebsocketServer::disconnected );
-    m_clients.append(socket);
+void WebsocketServer::incoming()
+{
+    while( m_server->hasPendingConnections() )
+    {
+        QTcpSocket *socket = m_server->nextPendingConnection();
+        WsClient *client = new WsClient( m_nextId++, socket, m_window, m_deflate, &m_takeoverStats, this );
+        connect( client, &WsClient::opened, this, &WebsocketServer::opened );
+        connect( client, &WsClient::message, this, &WebsocketServer::messageReceived );
+        connect( client, &WsClient::closed, this, &WebsocketServer::closed );
+    }
+}
 
-    emit newConnection(socket);
+void WebsocketServer::opened(quint32 id)
+{
+    WsClient *client = qobject_cast< WsClient * >( sender() );
+    m_clients.insert( id, client );
+    emit clientConnected( id, client->peer() );
 }
 
-void WebsocketServer::disconnected()
+void WebsocketServer::closed(quint32 id)
 {
-    QWebSocket *client = qobject_cast< QWebSocket * >( sender() );
-    if( m_clients.contains(client) )
-        m_clients.removeOne(client);
+    WsClient *client = qobject_cast< WsClient * >( sender() );
+    if( m_clients.remove(id) > 0 )
+        emit clientDisconnected(id);
 
     client->deleteLater();
 }
 
-int WebsocketServer::broadcast(const QString &packet)
+void WebsocketServer::send(quint32 id, const QByteArray &payload, bool binary, int live)
+{
+    WsClient *client = m_clients.value(id);
+    QByteArray plain;
+    QHash< int, QByteArray > shared;
+    if( client )
+        deliver( client, binary ? WS_BINARY : WS_TEXT, payload, live, plain, shared );
+}
+
+void WebsocketServer::broadcast(const QVector< quint32 > &ids, const QByteArray &payload, bool binary, int live)
 {
-    //printf("JSON: %s\n\n", packet.toStdString().c_str());
-    int received = 0;
-    foreach( QWebSocket *socket, m_clients )
+    // Every client gets a reference to the same bytes, unless its deflate context makes them its own:
+    QByteArray plain;
+    QHash< int, QByteArray > shared;
+    foreach( quint32 id, ids )
     {
-        socket->sendTextMessage(packet);
-        received++;
+        WsClient *client = m_clients.value(id);
+        if( client )
+            deliver( client, binary ? WS_BINARY : WS_TEXT, payload, live, plain, shared );
     }
-    return received;
+}
+
+void WebsocketServer::deliver(WsClient *client, quint8 opcode, const QByteArray &payload, int live, QByteArray &plain, QHash< int, QByteArray > &shared)
+{
+    const WsDeflate *deflate = client->deflate();
+    if( !deflate )
+    {
+        if( plain.isEmpty() )
+            plain = WsFrame::frame(opcode, payload);
+        client->write(plain, live);
+    }
+    else if( deflate->takeover() )
+        client->writeMessage(opcode, payload, live);
+    else
+    {
+        // Built once per window size, any client with one at least as big can read it:
+        int bits = deflate->windowBits();
+        if( !shared.contains(bits) )
+        {
+            QElapsedTimer cost;
+            cost.start();
+            QByteArray compressed = WsDeflate::compressOnce( payload, bits, m_deflate.memLevel );
+            m_sharedStats.add( payload.size(), compressed.size(), cost.nsecsElapsed() );
+            shared.insert( bits, WsFrame::frame(opcode, compressed, true) );
+        }
+        client->write(shared.value(bits), live);
+    }
+}
+
+void WebsocketServer::checkBacklog()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QJsonArray stats;
+
+    // Dropping one takes it off m_clients:
+    foreach( WsClient *client, m_clients )
+    {
+        qint64 behind = client->behind(now, m_highWaterBytes, m_highWaterMS);
+        if( behind >= m_behindLimitMS )
+        {
+            qWarning() << "Dropping websocket client" << client->peer() << "after" << behind / 1000 << "seconds behind with"
+                       << client->queued() << "frames," << client->queuedBytes() + client->inflightBytes() << "bytes pending and" << client->dropped() << "readings dropped";
+            client->abort();
+            continue;
+        }
+
+        qint64 oldest = client->oldest();
+
+        QJsonObject entry;
+        entry.insert("id", (qint64)client->id());
+        entry.insert("peer", client->peer());
+        entry.insert("queued", client->queued());
+        entry.insert("queuedBytes", client->queuedBytes());
+        entry.insert("inflightBytes", client->inflightBytes());
+        entry.insert("age", oldest > 0 ? now - oldest : 0);
+        entry.insert("sent", (qint64)client->sent());
+        entry.insert("dropped", (qint64)client->dropped());
+        entry.insert("deflate", !client->deflate() ? "off" : client->deflate()->takeover() ? "takeover" : "shared");
+        stats.append(entry);
+    }
+
+    emit statsReady(stats);
+    report();
+}
+
+void WebsocketServer::report()
+{
+    if( m_reportMS <= 0 || m_reportClock.elapsed() < m_reportMS )
+        return;
+
+    if( m_sharedStats.frames > 0 )
+        qDebug() << "Deflate, once per broadcast:" << m_sharedStats.summary();
+    if( m_takeoverStats.frames > 0 )
+        qDebug() << "Deflate, per client with context takeover:" << m_takeoverStats.summary();
+
+    m_sharedStats = CompressionStats();
+    m_takeoverStats = CompressionStats();
+    m_reportClock.restart();
 }
@@ -1,29 +1,76 @@
 #ifndef WEBSOCKETSERVER_H
 #define WEBSOCKETSERVER_H
 
+#include <QElapsedTimer>
+#include <QHash>
+#include <QJsonArray>
 #include <QObject>
-#include <QWebSocketServer>
+#include <QSettings>
+#include <QTcpServer>
+#include <QTimer>
+#include <QVector>
 
+#include "outqueue.h"
+#include "wsdeflate.h"
+
+class WsClient;
+
+// Accepts websocket clients and writes to them from its own thread, so a
+// thousand dashboards cost the Controller one message per broadcast. Each
+// broadcast is framed once, and compressed once for all the clients without
+// permessage-deflate context takeover. Clients are known to the Controller
+// only by ID.
 class WebsocketServer : public QObject
 {
     Q_OBJECT
 
-    QWebSocketServer    *m_server;
+    QTcpServer      *m_server;
+    quint16         m_port;
+    QHash< quint32, WsClient * > m_clients;    // By ID, once the handshake is done.
+    quint32         m_nextId;
+
+    // Per client backpressure:
+    qint64          m_window;
+    qint64          m_highWaterBytes;
+    qint64          m_highWaterMS;
+    qint64          m_behindLimitMS;    // How long a client may stay over either before it's dropped.
+    QTimer          *m_checkTimer;
+
+    DeflateConfig   m_deflate;
 
-    QList< QWebSocket * >   m_clients;
+    // Compression cost, reported every m_reportMS:
+    CompressionStats m_sharedStats;     // Compressed once per broadcast.
+    CompressionStats m_takeoverStats;   // Compressed per client.
+    QElapsedTimer   m_reportClock;
+    int             m_reportMS;
+
+    void deliver(WsClient *client, quint8 opcode, const QByteArray &payload, int live, QByteArray &plain, QHash< int, QByteArray > &shared);
+    void report();
 
 public:
-    explicit WebsocketServer(QObject *parent = 0);
+    explicit WebsocketServer(QSettings *settings, QObject *parent = 0);
 
 signals:
-    void newConnection( QWebSocket *socket );
+    void clientConnected(quint32 id, const QString &peer);
+    void clientDisconnected(quint32 id);
+    void messageReceived(quint32 id, const QString &message);
+
+    // Queue depth and drop counts of every client, once a second:
+    void statsReady(const QJsonArray &stats);
 
 public slots:
-    int broadcast(const QString &packet);
+    void start();
+
+    // 'live' readings replace any still waiting with the same key, -1 for
+    // anything that has to be delivered, LIVE_KEYFRAME() for a keyframe:
+    void send(quint32 id, const QByteArray &payload, bool binary, int live);
+    void broadcast(const QVector< quint32 > &ids, const QByteArray &payload, bool binary, int live);
 
 private slots:
     void incoming();
-    void disconnected();
+    void opened(quint32 id);
+    void closed(quint32 id);
+    void checkBacklog();
 };
 
 #endif // WEBSOCKETSERVER_H
@@ -0,0 +1,220 @@
+#include "wireformat.h"
+
+#include <QtEndian>
+
+#include <cstring>
+
+// Appends in place, the buffer is sized up front:
+class WireWriter
+{
+    QByteArray      &m_data;
+    int             m_pos;
+
+public:
+    WireWriter(QByteArray &data) : m_data(data), m_pos(0) {}
+
+    template< typename T > void put(T value)
+    {
+        qToLittleEndian< T >( value, (uchar*)m_data.data() + m_pos );
+        m_pos += sizeof(T);
+    }
+
+    void putFloat(float value)
+    {
+        quint32 bits;
+        memcpy( &bits, &value, sizeof(bits) );
+        put< quint32 >(bits);
+    }
+
+    void align(int to)
+    {
+        while( m_pos % to )
+            m_data[ m_pos++ ] = 0;
+    }
+
+    void header(quint8 type, quint16 device, quint32 extra)
+    {
+        put< quint8 >(type);
+        put< quint8 >(WIRE_VERSION);
+        put< quint16 >(device);
+        put< quint32 >(extra);
+    }
+};
+
+QByteArray WireFormat::reading(quint16 device, qint64 whence, const QVector< double > &values, const QVector< qint32 > &ages)
+{
+    int slots = values.size();
+    QByteArray data( 16 + slots * 8, '\0' );
+    WireWriter out(data);
+
+    out.header( WIRE_READING, device, slots );
+    out.put< qint64 >(whence);
+    for( int x=0; x < slots; x++ )
+        out.putFloat( values[x] );
+    for( int x=0; x < slots; x++ )
+        out.put< qint32 >( x < ages.size() ? ages[x] : 0 );
+
+    return data;
+}
+
+QByteArray WireFormat::history(quint16 device, const QList< WireSection > &sections)
+{
+    // Sized first: series boundaries and their padding.
+    int size = 8;
+    foreach( const WireSection &section, sections )
+    {
+        size += 8;
+        for( int first=0; first < section.rows.length(); )
+        {
+            int last = first;
+            while( last < section.rows.length() && section.rows[last].reg == section.rows[first].reg )
+                last++;
+            int rows = last - first;
+            size += 8 + rows * 16 + ( ( rows * 12 + 7 ) & ~7 );
+            first = last;
+        }
+    }
+
+    QByteArray data( size, '\0' );
+    WireWriter out(data);
+    out.header( WIRE_HISTORY, device, sections.length() );
+
+    foreach( const WireSection &section, sections )
+    {
+        const QList< HistoryRow > &rows = section.rows;
+
+        int series = 0;
+        for( int x=0; x < rows.length(); x++ )
+        {
+            if( x == 0 || rows[x].reg != rows[x - 1].reg )
+                series++;
+        }
+
+        out.put< quint8 >(section.tier);
+        out.put< quint8 >(0);
+        out.put< quint16 >(series);
+        out.put< quint32 >(0);
+
+        for( int first=0; first < rows.length(); )
+        {
+            int last = first;
+            while( last < rows.length() && rows[last].reg == rows[first].reg )
+                last++;
+
+            out.put< quint16 >( rows[first].reg );
+            out.put< quint16 >(0);
+            out.put< quint32 >( last - first );
+
+            // Column by column:
+            for( int x=first; x < last; x++ )
+                out.put< qint64 >( rows[x].tstart );
+            for( int x=first; x < last; x++ )
+                out.put< qint64 >( rows[x].tend );
+            for( int x=first; x < last; x++ )
+                out.putFloat( rows[x].min );
+            for( int x=first; x < last; x++ )
+                out.putFloat( rows[x].max );
+            for( int x=first; x < last; x++ )
+                out.putFloat( rows[x].average );
+            out.align(8);
+
+            first = last;
+        }
+    }
+
+    return data;
+}
+
+QByteArray WireFormat::delta(quint16 device, qint64 whence, qint64 key, const QVector< double > &values, const QVector< int > &changed, const QVector< qint32 > &ages)
+{
+    QVector< int > stale;
+    for( int x=0; x < ages.size(); x++ )
+    {
+        if( ages[x] != 0 )
+            stale.append(x);
+    }
+
+    int slotBytes = ( ( changed.size() + stale.size() ) * 2 + 3 ) & ~3;
+    QByteArray data( 32 + slotBytes + changed.size() * 4 + stale.size() * 4, '\0' );
+    WireWriter out(data);
+
+    out.header( WIRE_DELTA, device, changed.size() );
+    out.put< qint64 >(whence);
+    out.put< qint64 >(key);
+    out.put< quint32 >( stale.size() );
+    out.put< quint32 >(0);
+    foreach( int slot, changed )
+        out.put< quint16 >(slot);
+    foreach( int slot, stale )
+        out.put< quint16 >(slot);
+    out.align(4);
+    foreach( int slot, changed )
+        out.putFloat( values[slot] );
+    foreach( int slot, stale )
+        out.put< qint32 >( ages[slot] );
+
+    return data;
+}
+
+QByteArray WireFormat::summary(quint16 device, qint64 from, qint64 to, const QVector< int > &slotList, const QVector< Accumulator > &sums)
+{
+    QVector< int > gathered;
+    for( int x=0; x < slotList.size() && x < sums.size(); x++ )
+    {
+        if( sums[x].count > 0 )
+            gathered.append(x);
+    }
+
+    int n = gathered.size();
+    QByteArray data( 24 + ( ( n * 2 + 3 ) & ~3 ) + n * 12, '\0' );
+    WireWriter out(data);
+
+    out.header( WIRE_SUMMARY, device, n );
+    out.put< qint64 >(from);
+    out.put< qint64 >(to);
+    foreach( int x, gathered )
+        out.put< quint16 >( slotList[x] );
+    out.align(4);
+    foreach( int x, gathered )
+        out.putFloat( sums[x].min );
+    foreach( int x, gathered )
+        out.putFloat( sums[x].max );
+    foreach( int x, gathered )
+        out.putFloat( sums[x].mean() );
+
+    return data;
+}
+
+QByteArray WireFormat::latest(quint16 device, const QList< WireSeries > &series)
+{
+    int size = 8;
+    foreach( const WireSeries &one, series )
+    {
+        int columns = one.mins.isEmpty() ? 1 : 3;
+        size += 8 + one.whence.size() * 8 + ( ( one.whence.size() * 4 * columns + 7 ) & ~7 );
+    }
+
+    QByteArray data( size, '\0' );
+    WireWriter out(data);
+    out.header( WIRE_LATEST, device, series.length() );
+
+    foreach( const WireSeries &one, series )
+    {
+        out.put< quint16 >( one.slot );
+        out.put< quint8 >( one.mins.isEmpty() ? 0 : 1 );
+        out.put< quint8 >(0);
+        out.put< quint32 >( one.whence.size() );
+
+        foreach( qint64 whence, one.whence )
+            out.put< qint64 >(whence);
+        foreach( double value, one.values )
+            out.putFloat(value);
+        foreach( double value, one.mins )
+            out.putFloat(value);
+        foreach( double value, one.maxs )
+            out.putFloat(value);
+        out.align(8);
+    }
+
+    return data;
+}
@@ -0,0 +1,81 @@
+#ifndef WIREFORMAT_H
+#define WIREFORMAT_H
+
+#include <QByteArray>
+#include <QList>
+#include <QVector>
+
+#include "accumulator.h"
+#include "historystore.h"
+
+// Binary websocket frames, little-endian throughout. Every frame starts with
+// an 8 byte header and keeps each array on its natural alignment, so a
+// browser can wrap them in typed arrays where they lie:
+//
+//   header:   u8 type, u8 version, u16 device, u32 (per type, below)
+//
+//   WIRE_READING, header u32 = slots:
+//             i64 whence, f32 value[slots] (NaN if never read),
+//             i32 age[slots] (0 fresh, -1 never read, else ms since last good)
+//
+//   WIRE_HISTORY, header u32 = sections:
+//     each section: u8 tier, u8 0, u16 series, u32 0
+//     each series:  u16 register, u16 0, u32 rows,
+//                   i64 start[rows], i64 end[rows],
+//                   f32 min[rows], f32 max[rows], f32 avg[rows], padding to 8
+//
+//   WIRE_DELTA, header u32 = changed slots:
+//             i64 whence, i64 key (whence of the WIRE_READING keyframe it applies to),
+//             u32 stale, u32 0, u16 slot[changed], u16 staleSlot[stale], padding to 4,
+//             f32 value[changed], i32 age[stale]
+//             With key 0 it's no delta, just the slots a filtered subscription asked for.
+//
+//   WIRE_SUMMARY, header u32 = slots:
+//             i64 from, i64 to, u16 slot[slots], padding to 4,
+//             f32 min[slots], f32 max[slots], f32 avg[slots]
+//
+//   WIRE_LATEST, header u32 = series:
+//     each series: u16 slot, u8 flags (1 = has min/max), u8 0, u32 points,
+//                  i64 whence[points], f32 value[points],
+//                  f32 min[points], f32 max[points] (only with flag 1), padding to 8
+//
+// Register names, units and slots come once beforehand, in the JSON schema message.
+#define WIRE_VERSION 1
+#define WIRE_READING 1
+#define WIRE_HISTORY 2
+#define WIRE_DELTA 3
+#define WIRE_SUMMARY 4
+#define WIRE_LATEST 5
+
+struct WireSection
+{
+    int         tier;
+    QList< HistoryRow > rows;   // Grouped by register, as read from a store.
+};
+
+// Recent readings of one slot, oldest first:
+struct WireSeries
+{
+    int         slot;
+    QVector< qint64 > whence;
+    QVector< double > values;
+    QVector< double > mins;     // Only when thinned into runs, as are maxs.
+    QVector< double > maxs;
+};
+
+class WireFormat
+{
+public:
+    static QByteArray reading(quint16 device, qint64 whence, const QVector< double > &values, const QVector< qint32 > &ages);
+    static QByteArray history(quint16 device, const QList< WireSection > &sections);
+
+    // Only the slots in 'changed', and the ages of those with one:
+    static QByteArray delta(quint16 device, qint64 whence, qint64 key, const QVector< double > &values, const QVector< int > &changed, const QVector< qint32 > &ages);
+
+    // Per slot in 'slotList' that anything was gathered for, 'sums' by the same index:
+    static QByteArray summary(quint16 device, qint64 from, qint64 to, const QVector< int > &slotList, const QVector< Accumulator > &sums);
+
+    static QByteArray latest(quint16 device, const QList< WireSeries > &series);
+};
+
+#endif // WIREFORMAT_H
@@ -0,0 +1,339 @@
+#include "wsclient.h"
+#include "wsframe.h"
+
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QDebug>
+#include <QHash>
+#include <QHostAddress>
+#include <QtEndian>
+
+WsClient::WsClient(quint32 id, QTcpSocket *socket, qint64 window, const DeflateConfig &deflate, CompressionStats *stats, QObject *parent) : QObject(parent),
+    m_socket(socket),
+    m_id(id),
+    m_open(false),
+    m_closing(false),
+    m_opcode(0),
+    m_compressedMessage(false),
+    m_deflateConfig(deflate),
+    m_deflate(nullptr),
+    m_stats(stats),
+    m_window(window),
+    m_behindSince(0),
+    m_sent(0),
+    m_dropped(0)
+{
+    m_peer = socket->peerAddress().toString() + ":" + QString::number( socket->peerPort() );
+
+    m_socket->setParent(this);
+    m_socket->setSocketOption( QAbstractSocket::LowDelayOption, 1 );
+    connect( m_socket, &QTcpSocket::readyRead, this, &WsClient::readyRead );
+    connect( m_socket, &QTcpSocket::bytesWritten, this, &WsClient::bytesWritten );
+    connect( m_socket, &QTcpSocket::disconnected, this, &WsClient::disconnected );
+
+    // A connection that never finishes its upgrade would otherwise stay
+    // open, and its buffer allocated, for as long as the peer likes:
+    m_handshakeTimer = new QTimer(this);
+    m_handshakeTimer->setSingleShot(true);
+    m_handshakeTimer->setInterval(WS_HANDSHAKE_TIMEOUT);
+    connect( m_handshakeTimer, &QTimer::timeout, this, &WsClient::handshakeExpired );
+    m_handshakeTimer->start();
+}
+
+WsClient::~WsClient()
+{
+    delete m_deflate;
+}
+
+void WsClient::write(const QByteArray &frame, int live)
+{
+    if( !m_open || m_closing )
+        return;
+
+    m_dropped += m_queue.push( frame, 0, live, QDateTime::currentMSecsSinceEpoch() );
+    pump();
+}
+
+void WsClient::writeMessage(quint8 opcode, const QByteArray &payload, int live)
+{
+    if( !m_open || m_closing )
+        return;
+
+    m_dropped += m_queue.push( payload, opcode, live, QDateTime::currentMSecsSinceEpoch() );
+    pump();
+}
+
+void WsClient::pump()
+{
+    // Only a window's worth goes to the socket, the rest waits here where
+    // readings can still be superseded:
+    OutFrame frame;
+    while( m_socket->bytesToWrite() < m_window && m_queue.take(frame) )
+    {
+        if( frame.opcode == 0 )
+            m_socket->write(frame.payload);
+        else if( m_deflate )
+        {
+            QElapsedTimer cost;
+            cost.start();
+            QByteArray compressed = m_deflate->compress(frame.payload);
+            m_stats->add( frame.payload.size(), compressed.size(), cost.nsecsElapsed() );
+            m_socket->write( WsFrame::frame( frame.opcode, compressed, true ) );
+        }
+        else
+            m_socket->write( WsFrame::frame( frame.opcode, frame.payload ) );
+        m_sent++;
+    }
+}
+
+void WsClient::abort()
+{
+    m_queue.clear();
+    m_socket->abort();
+}
+
+qint64 WsClient::behind(qint64 now, qint64 highWaterBytes, qint64 highWaterMS)
+{
+    qint64 oldest = m_queue.oldest();
+    if( m_queue.bytes() + m_socket->bytesToWrite() <= highWaterBytes && ( oldest == 0 || now - oldest <= highWaterMS ) )
+    {
+        m_behindSince = 0;
+        return 0;
+    }
+
+    if( m_behindSince == 0 )
+        m_behindSince = now;
+    return qMax( (qint64)1, now - m_behindSince );
+}
+
+void WsClient::readyRead()
+{
+    m_in.append( m_socket->readAll() );
+
+    if( !m_open )
+    {
+        if( !handshake() || !m_open )
+            return;
+        emit opened(m_id);
+    }
+
+    parseFrames();
+}
+
+void WsClient::bytesWritten()
+{
+    pump();
+}
+
+void WsClient::disconnected()
+{
+    emit closed(m_id);
+}
+
+void WsClient::handshakeExpired()
+{
+    if( m_open )
+        return;
+
+    qDebug() << "Websocket handshake from" << m_peer << "timed out";
+    m_socket->abort();
+}
+
+bool WsClient::handshake()
+{
+    int end = m_in.indexOf("\r\n\r\n");
+    if( end < 0 )
+    {
+        if( m_in.size() > WS_MAX_HANDSHAKE )
+        {
+            m_socket->abort();
+            return false;
+        }
+        return true;
+    }
+
+    QList< QByteArray > lines = m_in.left(end).split('\n');
+    m_in.remove( 0, end + 4 );
+
+    // Repeated headers are one comma separated list:
+    QHash< QByteArray, QByteArray > headers;
+    for( int x=1; x < lines.length(); x++ )
+    {
+        int colon = lines[x].indexOf(':');
+        if( colon <= 0 )
+            continue;
+
+        QByteArray name = lines[x].left(colon).trimmed().toLower();
+        QByteArray value = lines[x].mid(colon + 1).trimmed();
+        if( headers.contains(name) )
+            value = headers.value(name) + ", " + value;
+        headers.insert( name, value );
+    }
+
+    bool upgrade = false;
+    foreach( const QByteArray &token, headers.value("connection").split(',') )
+        upgrade |= token.trimmed().toLower() == "upgrade";
+
+    if( !lines.first().startsWith("GET ") || !upgrade || headers.value("upgrade").toLower() != "websocket" || !headers.contains("sec-websocket-key") )
+    {
+        m_socket->write("HTTP/1.1 400 Bad Request\r\nConnection: close\r\nContent-Length: 0\r\n\r\n");
+        m_socket->disconnectFromHost();
+        return false;
+    }
+
+    // Only RFC 6455 framing is spoken, tell the client which version that is:
+    if( headers.value("sec-websocket-version") != "13" )
+    {
+        m_socket->write("HTTP/1.1 426 Upgrade Required\r\nSec-WebSocket-Version: 13\r\nConnection: close\r\nContent-Length: 0\r\n\r\n");
+        m_socket->disconnectFromHost();
+        return false;
+    }
+
+    QByteArray response = "HTTP/1.1 101 Switching Protocols\r\n"
+                          "Upgrade: websocket\r\n"
+                          "Connection: Upgrade\r\n"
+                          "Sec-WebSocket-Accept: " + WsFrame::accept( headers.value("sec-websocket-key") ) + "\r\n";
+
+    DeflateParams params;
+    QByteArray extension = WsDeflate::negotiate( headers.value("sec-websocket-extensions"), m_deflateConfig, params );
+    if( !extension.isEmpty() )
+    {
+        m_deflate = new WsDeflate( params, m_deflateConfig.memLevel );
+        response += "Sec-WebSocket-Extensions: " + extension + "\r\n";
+    }
+
+    m_socket->write(response + "\r\n");
+    m_handshakeTimer->stop();
+    m_open = true;
+    return true;
+}
+
+bool WsClient::parseFrames()
+{
+    while( !m_closing && m_in.size() >= 2 )
+    {
+        const uchar *d = reinterpret_cast< const uchar * >( m_in.constData() );
+        bool fin = d[0] & 0x80;
+        bool compressed = d[0] & 0x40;
+        quint8 opcode = d[0] & 0x0F;
+        quint64 length = d[1] & 0x7F;
+        int header = 2;
+
+        // Clients always mask, and only permessage-deflate sets RSV1, on the first frame of a message:
+        if( !( d[1] & 0x80 ) || ( d[0] & 0x30 ) || ( compressed && ( !m_deflate || opcode == WS_CONTINUATION || ( opcode & 0x08 ) ) ) )
+        {
+            fail(1002);
+            return false;
+        }
+
+        if( length == 126 )
+        {
+            if( m_in.size() < 4 )
+                return true;
+            length = qFromBigEndian< quint16 >( d + 2 );
+            header = 4;
+        }
+        else if( length == 127 )
+        {
+            if( m_in.size() < 10 )
+                return true;
+            length = qFromBigEndian< quint64 >( d + 2 );
+            header = 10;
+        }
+
+        if( length > WS_MAX_MESSAGE )
+        {
+            fail(1009);
+            return false;
+        }
+        if( (quint64)m_in.size() < header + 4 + length )
+            return true;
+
+        const uchar *mask = d + header;
+        QByteArray payload = m_in.mid( header + 4, length );
+        char *p = payload.data();
+        for( int x=0; x < payload.size(); x++ )
+            p[x] ^= mask[x % 4];
+        m_in.remove( 0, header + 4 + length );
+
+        // Control frames may turn up between the fragments of a message:
+        if( opcode & 0x08 )
+        {
+            if( !fin || length > 125 )
+            {
+                fail(1002);
+                return false;
+            }
+
+            if( opcode == WS_CLOSE )
+            {
+                m_closing = true;
+                m_socket->write( WsFrame::frame( WS_CLOSE, payload.left(2) ) );
+                m_socket->disconnectFromHost();
+                return false;
+            }
+            if( opcode == WS_PING )
+                m_socket->write( WsFrame::frame( WS_PONG, payload ) );
+            continue;
+        }
+
+        if( opcode == WS_CONTINUATION )
+        {
+            if( m_opcode == 0 )
+            {
+                fail(1002);
+                return false;
+            }
+            m_message.append(payload);
+        }
+        else
+        {
+            if( m_opcode != 0 )
+            {
+                fail(1002);
+                return false;
+            }
+            m_opcode = opcode;
+            m_compressedMessage = compressed;
+            m_message = payload;
+        }
+
+        if( m_message.size() > WS_MAX_MESSAGE )
+        {
+            fail(1009);
+            return false;
+        }
+
+        if( fin )
+        {
+            QByteArray inflated;
+            if( m_compressedMessage )
+            {
+                if( !m_deflate->decompress(m_message, inflated, WS_MAX_MESSAGE) )
+                {
+                    fail(1007);
+                    return false;
+                }
+                m_message = inflated;
+            }
+
+            // Requests are JSON, anything binary is ignored:
+            if( m_opcode == WS_TEXT )
+                emit message( m_id, QString::fromUtf8(m_message) );
+            m_message.clear();
+            m_opcode = 0;
+        }
+    }
+
+    return true;
+}
+
+void WsClient::fail(quint16 code)
+{
+    qDebug() << "Websocket client" << m_peer << "closed with" << code;
+
+    m_closing = true;
+    m_queue.clear();
+    m_socket->write( WsFrame::close(code) );
+    m_socket->disconnectFromHost();
+}
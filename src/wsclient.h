@@ -0,0 +1,92 @@
+#ifndef WSCLIENT_H
+#define WSCLIENT_H
+
+#include <QByteArray>
+#include <QObject>
+#include <QTcpSocket>
+#include <QTimer>
+
+#include "outqueue.h"
+#include "wsdeflate.h"
+
+// Largest HTTP upgrade request accepted:
+#define WS_MAX_HANDSHAKE 8192
+// Milliseconds a new connection gets to complete it:
+#define WS_HANDSHAKE_TIMEOUT 10000
+
+// One websocket client, living on the websocket thread. Does the upgrade
+// handshake, reassembles the client's messages and writes frames that were
+// built elsewhere, through its own queue so a slow reader only ever holds
+// up itself. Messages to a client with permessage-deflate context takeover
+// are compressed just before they go out, so superseded ones never become
+// part of its context.
+class WsClient : public QObject
+{
+    Q_OBJECT
+
+    QTcpSocket      *m_socket;
+    quint32         m_id;
+    QString         m_peer;
+    bool            m_open;     // Handshake done.
+    bool            m_closing;
+    QTimer          *m_handshakeTimer;
+
+    QByteArray      m_in;       // Received, not parsed yet.
+    QByteArray      m_message;  // Fragments of the message being reassembled.
+    quint8          m_opcode;   // Of that message, 0 if there's none.
+    bool            m_compressedMessage;
+
+    DeflateConfig   m_deflateConfig;
+    WsDeflate       *m_deflate; // Null unless negotiated.
+    CompressionStats *m_stats;  // The server's, for messages compressed here.
+
+    OutQueue        m_queue;
+    qint64          m_window;   // Bytes left to the socket's own buffer at once.
+    qint64          m_behindSince;
+    quint32         m_sent;
+    quint32         m_dropped;
+
+    bool handshake();
+    bool parseFrames();
+    void fail(quint16 code);
+    void pump();
+
+public:
+    explicit WsClient(quint32 id, QTcpSocket *socket, qint64 window, const DeflateConfig &deflate, CompressionStats *stats, QObject *parent = 0);
+    ~WsClient();
+
+    // 'frame' is ready to go as is. A live one replaces any frame of the same
+    // 'live' key still waiting, -1 and LIVE_KEYFRAME() are always delivered:
+    void write(const QByteArray &frame, int live);
+
+    // The same for a message still to be compressed, if need be, and framed:
+    void writeMessage(quint8 opcode, const QByteArray &payload, int live);
+
+    const WsDeflate *deflate() const { return m_deflate; }
+    void abort();
+
+    // How long it has been over either high-water mark, 0 if it isn't:
+    qint64 behind(qint64 now, qint64 highWaterBytes, qint64 highWaterMS);
+
+    quint32 id() const { return m_id; }
+    const QString &peer() const { return m_peer; }
+    int queued() const { return m_queue.count(); }
+    qint64 queuedBytes() const { return m_queue.bytes(); }
+    qint64 inflightBytes() const { return m_socket->bytesToWrite(); }
+    qint64 oldest() const { return m_queue.oldest(); }
+    quint32 sent() const { return m_sent; }
+    quint32 dropped() const { return m_dropped; }
+
+signals:
+    void opened(quint32 id);
+    void message(quint32 id, const QString &text);
+    void closed(quint32 id);
+
+private slots:
+    void readyRead();
+    void bytesWritten();
+    void disconnected();
+    void handshakeExpired();
+};
+
+#endif // WSCLIENT_H
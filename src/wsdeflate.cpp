@@ -0,0 +1,207 @@
+#include "wsdeflate.h"
+
+#include <cstring>
+
+void CompressionStats::add(qint64 in, qint64 out, qint64 nsecs)
+{
+    frames++;
+    raw += in;
+    wire += out;
+    ns += nsecs;
+}
+
+QString CompressionStats::summary() const
+{
+    if( frames == 0 )
+        return "no frames";
+
+    return QString("%1 frames, avg %2 -> %3 bytes, %4 us each").arg(frames).arg(raw / frames).arg(wire / frames).arg( ns / frames / 1000.0, 0, 'f', 1 );
+}
+
+// Compresses and flushes one message, leaving off the empty stored block
+// every flush ends in (RFC 7692 7.2.1):
+static QByteArray deflateMessage(z_stream *z, const QByteArray &payload)
+{
+    QByteArray out( deflateBound(z, payload.size()) + 16, Qt::Uninitialized );
+    z->next_in = reinterpret_cast< Bytef * >( const_cast< char * >( payload.constData() ) );
+    z->avail_in = payload.size();
+
+    int used = 0;
+    do
+    {
+        if( used == out.size() )
+            out.resize( out.size() * 2 );
+        z->next_out = reinterpret_cast< Bytef * >( out.data() + used );
+        z->avail_out = out.size() - used;
+        deflate(z, Z_SYNC_FLUSH);
+        used = out.size() - z->avail_out;
+    } while( z->avail_out == 0 );
+
+    out.resize(used);
+    if( out.endsWith( QByteArray("\x00\x00\xff\xff", 4) ) )
+        out.chop(4);
+    return out;
+}
+
+WsDeflate::WsDeflate(const DeflateParams &params, int memLevel) :
+    m_params(params),
+    m_memLevel(memLevel),
+    m_deflateReady(false),
+    m_inflateReady(false)
+{
+}
+
+WsDeflate::~WsDeflate()
+{
+    if( m_deflateReady )
+        deflateEnd(&m_deflate);
+    if( m_inflateReady )
+        inflateEnd(&m_inflate);
+}
+
+QByteArray WsDeflate::negotiate(const QByteArray &offers, const DeflateConfig &config, DeflateParams &params)
+{
+    if( !config.enabled )
+        return QByteArray();
+
+    foreach( const QByteArray &offer, offers.split(',') )
+    {
+        QList< QByteArray > parts = offer.split(';');
+        if( parts.first().trimmed() != "permessage-deflate" )
+            continue;
+
+        params.serverBits = config.windowBits;
+        params.clientBits = 15;
+        params.serverTakeover = config.takeover;
+        params.clientTakeover = true;
+
+        bool ok = true, clientBits = false;
+        QList< QByteArray > seen;
+        for( int x=1; x < parts.length() && ok; x++ )
+        {
+            int equals = parts[x].indexOf('=');
+            QByteArray name = parts[x].left(equals).trimmed();
+            QByteArray value = equals < 0 ? QByteArray() : parts[x].mid(equals + 1).trimmed();
+            if( value.startsWith('"') && value.endsWith('"') && value.size() >= 2 )
+                value = value.mid(1, value.size() - 2);
+
+            if( seen.contains(name) )
+                ok = false;
+            seen.append(name);
+
+            bool valid = true;
+            int bits = value.toInt(&valid);
+            valid = valid && bits >= 8 && bits <= 15;
+
+            if( name == "server_no_context_takeover" )
+                params.serverTakeover = false;
+            else if( name == "client_no_context_takeover" )
+                params.clientTakeover = false;
+            else if( name == "server_max_window_bits" )
+            {
+                // zlib can't compress with a 256 byte window:
+                if( !valid || bits < 9 )
+                    ok = false;
+                else
+                    params.serverBits = qMin( params.serverBits, bits );
+            }
+            else if( name == "client_max_window_bits" )
+            {
+                if( value.isEmpty() )
+                    clientBits = true;
+                else if( valid )
+                    params.clientBits = bits;
+                else
+                    ok = false;
+            }
+            else
+                ok = false;
+        }
+        if( !ok )
+            continue;
+
+        // Keeps the client's window, and so our inflater, as small as ours:
+        if( clientBits )
+            params.clientBits = qMin( params.clientBits, config.windowBits );
+
+        QByteArray response = "permessage-deflate";
+        if( !params.serverTakeover )
+            response += "; server_no_context_takeover";
+        if( !params.clientTakeover )
+            response += "; client_no_context_takeover";
+        if( params.serverBits < 15 )
+            response += "; server_max_window_bits=" + QByteArray::number(params.serverBits);
+        if( clientBits )
+            response += "; client_max_window_bits=" + QByteArray::number(params.clientBits);
+        return response;
+    }
+
+    return QByteArray();
+}
+
+QByteArray WsDeflate::compressOnce(const QByteArray &payload, int windowBits, int memLevel)
+{
+    z_stream z;
+    memset( &z, 0, sizeof(z) );
+    if( deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -windowBits, memLevel, Z_DEFAULT_STRATEGY) != Z_OK )
+        return QByteArray();
+
+    QByteArray out = deflateMessage(&z, payload);
+    deflateEnd(&z);
+    return out;
+}
+
+QByteArray WsDeflate::compress(const QByteArray &payload)
+{
+    if( !m_deflateReady )
+    {
+        memset( &m_deflate, 0, sizeof(m_deflate) );
+        if( deflateInit2(&m_deflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -m_params.serverBits, m_memLevel, Z_DEFAULT_STRATEGY) != Z_OK )
+            return QByteArray();
+        m_deflateReady = true;
+    }
+
+    QByteArray out = deflateMessage(&m_deflate, payload);
+    if( !m_params.serverTakeover )
+        deflateReset(&m_deflate);
+    return out;
+}
+
+bool WsDeflate::decompress(const QByteArray &payload, QByteArray &out, int limit)
+{
+    if( !m_inflateReady )
+    {
+        memset( &m_inflate, 0, sizeof(m_inflate) );
+        if( inflateInit2(&m_inflate, -m_params.clientBits) != Z_OK )
+            return false;
+        m_inflateReady = true;
+    }
+
+    // Put back the tail the client left off:
+    QByteArray in = payload + QByteArray("\x00\x00\xff\xff", 4);
+    m_inflate.next_in = reinterpret_cast< Bytef * >( in.data() );
+    m_inflate.avail_in = in.size();
+
+    out.resize( qMax( 1024, payload.size() * 4 ) );
+    int used = 0, ret;
+    do
+    {
+        if( out.size() - used < 1024 )
+            out.resize( out.size() * 2 );
+        m_inflate.next_out = reinterpret_cast< Bytef * >( out.data() + used );
+        m_inflate.avail_out = out.size() - used;
+        ret = inflate(&m_inflate, Z_SYNC_FLUSH);
+        used = out.size() - m_inflate.avail_out;
+
+        if( ( ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR ) || used > limit )
+        {
+            inflateReset(&m_inflate);
+            return false;
+        }
+    } while( ret != Z_STREAM_END && m_inflate.avail_out == 0 );
+
+    out.resize(used);
+    if( !m_params.clientTakeover || ret == Z_STREAM_END )
+        inflateReset(&m_inflate);
+    return true;
+}
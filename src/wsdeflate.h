@@ -0,0 +1,72 @@
+#ifndef WSDEFLATE_H
+#define WSDEFLATE_H
+
+#include <QByteArray>
+#include <QString>
+
+#include <zlib.h>
+
+// What the server offers, from the settings:
+struct DeflateConfig
+{
+    bool            enabled;
+    int             windowBits; // server_max_window_bits, 9 to 15.
+    int             memLevel;   // zlib's, 1 to 9. Memory per client is about 2^(windowBits+2) + 2^(memLevel+9).
+    bool            takeover;   // Keep each client's context between messages.
+};
+
+// What was agreed with one client (RFC 7692):
+struct DeflateParams
+{
+    int             serverBits;
+    int             clientBits;
+    bool            serverTakeover;
+    bool            clientTakeover;
+};
+
+// Bytes in and out and the time it took, to compare compression modes by:
+struct CompressionStats
+{
+    CompressionStats() : frames(0), raw(0), wire(0), ns(0) {}
+
+    quint32         frames;
+    qint64          raw;
+    qint64          wire;
+    qint64          ns;
+
+    void add(qint64 in, qint64 out, qint64 nsecs);
+    QString summary() const;
+};
+
+// permessage-deflate for one websocket client. With context takeover each
+// message is compressed against the ones before it, so consecutive readings
+// cost a few bytes, but no two clients' frames are the same anymore.
+class WsDeflate
+{
+    DeflateParams   m_params;
+    int             m_memLevel;
+    z_stream        m_deflate;
+    z_stream        m_inflate;
+    bool            m_deflateReady;
+    bool            m_inflateReady; // Only set up once the client sends something compressed.
+
+public:
+    explicit WsDeflate(const DeflateParams &params, int memLevel);
+    ~WsDeflate();
+
+    // Accepts the first permessage-deflate offer in a Sec-WebSocket-Extensions
+    // header it can. Returns the response to it, empty if there was none:
+    static QByteArray negotiate(const QByteArray &offers, const DeflateConfig &config, DeflateParams &params);
+
+    // Without context takeover the result only depends on the payload, one
+    // compression serves every such client:
+    static QByteArray compressOnce(const QByteArray &payload, int windowBits, int memLevel);
+
+    QByteArray compress(const QByteArray &payload);
+    bool decompress(const QByteArray &payload, QByteArray &out, int limit);
+
+    bool takeover() const { return m_params.serverTakeover; }
+    int windowBits() const { return m_params.serverBits; }
+};
+
+#endif // WSDEFLATE_H
@@ -0,0 +1,43 @@
+#include "wsframe.h"
+
+#include <QCryptographicHash>
+#include <QtEndian>
+
+#include <cstring>
+
+QByteArray WsFrame::frame(quint8 opcode, const QByteArray &payload, bool compressed)
+{
+    quint64 size = payload.size();
+    int header = size > 65535 ? 10 : size > 125 ? 4 : 2;
+
+    QByteArray out( header + payload.size(), Qt::Uninitialized );
+    uchar *d = reinterpret_cast< uchar * >( out.data() );
+    d[0] = 0x80 | ( compressed ? 0x40 : 0 ) | ( opcode & 0x0F );
+    if( header == 10 )
+    {
+        d[1] = 127;
+        qToBigEndian< quint64 >( size, d + 2 );
+    }
+    else if( header == 4 )
+    {
+        d[1] = 126;
+        qToBigEndian< quint16 >( size, d + 2 );
+    }
+    else
+        d[1] = size;
+
+    memcpy( d + header, payload.constData(), payload.size() );
+    return out;
+}
+
+QByteArray WsFrame::close(quint16 code)
+{
+    uchar payload[2];
+    qToBigEndian< quint16 >( code, payload );
+    return frame( WS_CLOSE, QByteArray( reinterpret_cast< const char * >( payload ), 2 ) );
+}
+
+QByteArray WsFrame::accept(const QByteArray &key)
+{
+    return QCryptographicHash::hash( key.trimmed() + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11", QCryptographicHash::Sha1 ).toBase64();
+}
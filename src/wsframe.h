@@ -0,0 +1,32 @@
+#ifndef WSFRAME_H
+#define WSFRAME_H
+
+#include <QByteArray>
+
+// RFC 6455 opcodes:
+#define WS_CONTINUATION 0x0
+#define WS_TEXT 0x1
+#define WS_BINARY 0x2
+#define WS_CLOSE 0x8
+#define WS_PING 0x9
+#define WS_PONG 0xA
+
+// Largest message a client may send us, reassembled:
+#define WS_MAX_MESSAGE 65536
+
+// Server side websocket framing. A frame is built once and the very same
+// bytes are written to every socket it goes to.
+class WsFrame
+{
+public:
+    // A whole message in one unmasked frame, 'compressed' if it's permessage-deflate's:
+    static QByteArray frame(quint8 opcode, const QByteArray &payload, bool compressed=false);
+
+    // Close frame carrying a status code:
+    static QByteArray close(quint16 code);
+
+    // The Sec-WebSocket-Accept answer to a client's Sec-WebSocket-Key:
+    static QByteArray accept(const QByteArray &key);
+};
+
+#endif // WSFRAME_H